@@ -3,13 +3,33 @@
 #ifndef AST_H
 #define AST_H
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
+/// ExprKind - Discriminator for the concrete ExprAST subclasses, so that the
+/// interpreter and later passes can dispatch with a switch instead of RTTI.
+enum ExprKind
+{
+    expr_number,
+    expr_variable,
+    expr_binary,
+    expr_call,
+};
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
+  private:
+    ExprKind kind;
+
   public:
+    ExprAST(ExprKind kind)
+    : kind(kind)
+    { }
     virtual ~ExprAST() {}
+
+    ExprKind getKind() const { return kind; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0"
@@ -19,19 +39,28 @@ class NumberExprAST : public ExprAST {
 
   public:
     NumberExprAST(double value)
-    : value(value)
+    : ExprAST(expr_number)
+    , value(value)
     { }
+
+    double getValue() const { return value; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
   private:
     std::string name;
+    unsigned index = 0; // Position in the enclosing prototype, set by ResolveFunction.
 
   public:
     VariableExprAST(const std::string& name)
-    : name(name)
+    : ExprAST(expr_variable)
+    , name(name)
     { }
+
+    const std::string& getName() const { return name; }
+    unsigned getIndex() const { return index; }
+    void setIndex(unsigned i) { index = i; }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -39,13 +68,27 @@ class BinaryExprAST : public ExprAST {
   private:
     char op;
     std::unique_ptr<ExprAST> LHS, RHS;
+    // Evaluate LHS and RHS as forked tasks, set by MarkForkPoints. Atomic since
+    // it may be reset while other threads evaluate the same body.
+    std::atomic<bool> parallel{false};
 
   public:
     BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-    : op(op)
+    : ExprAST(expr_binary)
+    , op(op)
     , LHS(std::move(LHS))
     , RHS(std::move(RHS))
     { }
+
+    char getOp() const { return op; }
+    const ExprAST& getLHS() const { return *LHS; }
+    const ExprAST& getRHS() const { return *RHS; }
+    ExprAST& getLHS() { return *LHS; }
+    ExprAST& getRHS() { return *RHS; }
+    std::unique_ptr<ExprAST>& getLHSPtr() { return LHS; }
+    std::unique_ptr<ExprAST>& getRHSPtr() { return RHS; }
+    bool isParallel() const { return parallel.load(std::memory_order_relaxed); }
+    void setParallel(bool p) { parallel.store(p, std::memory_order_relaxed); }
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -53,12 +96,20 @@ class CallExprAST : public ExprAST {
   private:
     std::string callee;
     std::vector<std::unique_ptr<ExprAST> > args;
+    unsigned slot = 0; // Index into the interpreter's FunctionSlots, set by ResolveFunction.
 
   public:
     CallExprAST(const std::string& callee, std::vector<std::unique_ptr<ExprAST> > args)
-    : callee(callee)
+    : ExprAST(expr_call)
+    , callee(callee)
     , args(std::move(args))
     { }
+
+    const std::string& getCallee() const { return callee; }
+    const std::vector<std::unique_ptr<ExprAST> >& getArgs() const { return args; }
+    std::vector<std::unique_ptr<ExprAST> >& getArgs() { return args; }
+    unsigned getSlot() const { return slot; }
+    void setSlot(unsigned s) { slot = s; }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -76,6 +127,7 @@ class PrototypeAST {
     { }
 
     const std::string& getName() const { return name; }
+    const std::vector<std::string>& getArgs() const { return args; }
 };
 
 /// FunctionAST - This class represents a function definition itself.
@@ -83,12 +135,20 @@ class FunctionAST {
   private:
     std::unique_ptr<PrototypeAST> prototype;
     std::unique_ptr<ExprAST> body;
+    std::vector<bool> unusedArgs; // Filled in by the dead-argument pass.
 
   public:
     FunctionAST(std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<ExprAST> body)
     : prototype(std::move(prototype))
     , body(std::move(body))
     { }
+
+    const PrototypeAST& getPrototype() const { return *prototype; }
+    const ExprAST& getBody() const { return *body; }
+    ExprAST& getBody() { return *body; }
+    std::unique_ptr<ExprAST>& getBodyPtr() { return body; }
+    const std::vector<bool>& getUnusedArgs() const { return unusedArgs; }
+    void setUnusedArgs(std::vector<bool> unused) { unusedArgs = std::move(unused); }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,209 @@
+// Parallel batch evaluation
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "interpreter.h"
+#include "ir.h"
+#include "threadpool.h"
+#include "vecmath.h"
+
+/// BatchChunkBytes - Target working set of one batch chunk (its argument rows
+/// plus results), sized to stay resident in a typical L1 data cache.
+static size_t BatchChunkBytes = 32 * 1024;
+/// VectorMath - Evaluate batches a block of rows at a time over the function's
+/// IR, so that calls to exp, log, sin and cos use the vector versions from
+/// vecmath.h. Results may then differ from libm in the last place.
+static bool VectorMath = false;
+/// BatchBlockRows - Rows evaluated together by EvaluateIRBlock.
+static const size_t BatchBlockRows = 64;
+
+/// ReadBatchRows - Read one row of `arity` numbers per non-empty line of
+/// `file`, separated by whitespace or commas, appending them to `rows`. Stops
+/// after `maxRows` rows; `lineNo` counts lines across calls, for diagnostics.
+bool ReadBatchRows(FILE *file, size_t arity, std::vector<double>& rows, size_t& numRows, size_t maxRows,
+                   size_t& lineNo)
+{
+    numRows = 0;
+    std::string line;
+    int c;
+    do
+    {
+        if (numRows == maxRows)
+            return true;
+        c = fgetc(file);
+        if (c != '\n' && c != EOF)
+        {
+            line += (char)c;
+            continue;
+        }
+        ++lineNo;
+
+        size_t count = 0;
+        const char *p = line.c_str();
+        while (true)
+        {
+            while (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')
+                ++p;
+            if (!*p)
+                break;
+            char *end;
+            double value = strtod(p, &end);
+            if (end == p)
+                return LogErrorR("Malformed number in batch row " + std::to_string(lineNo));
+            rows.push_back(value);
+            ++count;
+            p = end;
+        }
+        line.clear();
+
+        if (count == 0)
+            continue; // blank line
+        if (count != arity)
+            return LogErrorR("Batch row " + std::to_string(lineNo) + " has " + std::to_string(count) +
+                             " values, expected " + std::to_string(arity));
+        ++numRows;
+    } while (c != EOF);
+    return true;
+}
+
+bool ReadBatchRows(FILE *file, size_t arity, std::vector<double>& rows, size_t& numRows)
+{
+    size_t lineNo = 0;
+    return ReadBatchRows(file, arity, rows, numRows, SIZE_MAX, lineNo);
+}
+
+/// EvaluateIRBlock - Run `function` on `count` rows of `rows` (row-major,
+/// `arity` values per row) at once, one instruction for all rows before the
+/// next. Intrinsic calls get whole columns, other calls go one row at a time.
+/// `values` is scratch space, reused between blocks.
+void EvaluateIRBlock(const IRFunction& function, const double *rows, size_t arity, size_t count, double *results,
+                     std::vector<double>& values)
+{
+    const std::vector<IRInst>& insts = function.insts;
+    values.resize(insts.size() * BatchBlockRows);
+    for (size_t i = 0; i < insts.size(); ++i)
+    {
+        const IRInst& inst = insts[i];
+        double *v = values.data() + i * BatchBlockRows;
+        const double *a = inst.operands.size() > 0 ? values.data() + inst.operands[0] * BatchBlockRows : nullptr;
+        const double *b = inst.operands.size() > 1 ? values.data() + inst.operands[1] * BatchBlockRows : nullptr;
+        switch (inst.op)
+        {
+        case ir_const:
+            std::fill(v, v + count, inst.value);
+            break;
+        case ir_arg:
+            for (size_t r = 0; r < count; ++r)
+                v[r] = rows[r * arity + inst.index];
+            break;
+        case ir_add:
+            for (size_t r = 0; r < count; ++r)
+                v[r] = a[r] + b[r];
+            break;
+        case ir_sub:
+            for (size_t r = 0; r < count; ++r)
+                v[r] = a[r] - b[r];
+            break;
+        case ir_mul:
+            for (size_t r = 0; r < count; ++r)
+                v[r] = a[r] * b[r];
+            break;
+        case ir_lt:
+            for (size_t r = 0; r < count; ++r)
+                v[r] = a[r] < b[r] ? 1.0 : 0.0;
+            break;
+        case ir_copy:
+            std::copy(a, a + count, v);
+            break;
+        case ir_call:
+        {
+            const FunctionSlot& slot = CallSlot(inst.index);
+            const FunctionVersion& version = *slot.version.load(std::memory_order_acquire);
+            std::vector<const double *> columns;
+            for (unsigned operand : inst.operands)
+                columns.push_back(values.data() + operand * BatchBlockRows);
+            if (version.isExtern && version.intrinsic)
+            {
+                VectorIntrinsic(version.intrinsic, columns.data(), v, count);
+                break;
+            }
+            std::vector<double> argv(columns.size());
+            for (size_t r = 0; r < count; ++r)
+            {
+                for (size_t k = 0; k < columns.size(); ++k)
+                    argv[k] = columns[k][r];
+                v[r] = EvaluateFunction(slot, argv.data());
+            }
+            break;
+        }
+        }
+    }
+    const double *result = values.data() + function.result * BatchBlockRows;
+    std::copy(result, result + count, results);
+}
+
+/// EvaluateBatch - Evaluate `name` once per row of `rows` (row-major, one
+/// argument tuple per row) and store the results in row order. The rows are cut
+/// into cache-sized chunks that the pool's workers pull and steal, and each
+/// chunk writes only its own slice of `results`, so the output is identical to
+/// a sequential run whatever the scheduling.
+bool EvaluateBatch(const std::string& name, const std::vector<double>& rows, size_t numRows,
+                   std::vector<double>& results, ThreadPool& pool)
+{
+    std::unique_lock<std::recursive_mutex> lock(TableMutex);
+    const FunctionSlot *slot = ReferenceFunction(name);
+    if (!slot || slot->isExtern)
+        return LogErrorR("Unknown function referenced '" + name + "'");
+    size_t arity = slot->arity;
+    if (rows.size() != numRows * arity)
+        return LogErrorR("Batch input does not match the arity of '" + name + "'");
+
+    if (!BackgroundCompilation)
+        FlushCompileBatch();
+    PrepareForEvaluation();
+    results.assign(numRows, 0.0);
+    if (numRows == 0)
+        return true;
+
+    size_t rowBytes = (arity + 1) * sizeof(double);
+    size_t rowsPerChunk = std::max<size_t>(1, BatchChunkBytes / rowBytes);
+    size_t numChunks = (numRows + rowsPerChunk - 1) / rowsPerChunk;
+
+    if (VectorMath)
+    {
+        IRFunction ir = LowerToIR(slot->name, arity, slot->definition->getBody());
+        lock.unlock();
+        pool.parallelFor(numChunks, [&](size_t chunk) {
+            EpochGuard guard;
+            size_t begin = chunk * rowsPerChunk;
+            size_t end = std::min(numRows, begin + rowsPerChunk);
+            std::vector<double> values;
+            for (size_t row = begin; row < end; row += BatchBlockRows)
+            {
+                size_t count = std::min(BatchBlockRows, end - row);
+                EvaluateIRBlock(ir, rows.data() + row * arity, arity, count, results.data() + row, values);
+            }
+        });
+        return true;
+    }
+
+    lock.unlock();
+    pool.parallelFor(numChunks, [&](size_t chunk) {
+        EpochGuard guard;
+        size_t begin = chunk * rowsPerChunk;
+        size_t end = std::min(numRows, begin + rowsPerChunk);
+        for (size_t row = begin; row < end; ++row)
+            results[row] = EvaluateFunction(*slot, rows.data() + row * arity);
+    });
+    return true;
+}
+
+#endif
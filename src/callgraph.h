@@ -0,0 +1,230 @@
+// Call graph analyses
+
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+
+/// CollectCallees - Append the slot index of every call in `expr` to
+/// `callees`. The expression must already be resolved.
+void CollectCallees(const ExprAST& expr, std::vector<unsigned>& callees)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        return;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        CollectCallees(bin.getLHS(), callees);
+        CollectCallees(bin.getRHS(), callees);
+        return;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        callees.push_back(call.getSlot());
+        for (const auto& arg : call.getArgs())
+            CollectCallees(*arg, callees);
+        return;
+    }
+    }
+}
+
+/// ContainsCall - Whether evaluating `expr` calls another function.
+bool ContainsCall(const ExprAST& expr)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        return false;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        return ContainsCall(bin.getLHS()) || ContainsCall(bin.getRHS());
+    }
+    case expr_call:
+        return true;
+    }
+    return false;
+}
+
+/// ComputePurity - Given the callees of every function and which functions
+/// are impure in themselves (externs with unknown side effects), return which
+/// functions are pure: those that cannot reach an impure one along call edges.
+std::vector<bool> ComputePurity(const std::vector<std::vector<unsigned> >& callees,
+                                const std::vector<bool>& impureRoots)
+{
+    size_t n = callees.size();
+    std::vector<std::vector<unsigned> > callers(n);
+    for (unsigned f = 0; f < n; ++f)
+        for (unsigned callee : callees[f])
+            callers[callee].push_back(f);
+
+    // Impurity flows from each impure root back to everything that calls it.
+    std::vector<bool> pure(n, true);
+    std::vector<unsigned> worklist;
+    for (unsigned f = 0; f < n; ++f)
+    {
+        if (impureRoots[f])
+        {
+            pure[f] = false;
+            worklist.push_back(f);
+        }
+    }
+    while (!worklist.empty())
+    {
+        unsigned f = worklist.back();
+        worklist.pop_back();
+        for (unsigned caller : callers[f])
+        {
+            if (pure[caller])
+            {
+                pure[caller] = false;
+                worklist.push_back(caller);
+            }
+        }
+    }
+    return pure;
+}
+
+/// CostUnbounded - Estimated cost of anything that may recurse without limit.
+static const double CostUnbounded = 1e18;
+/// ExternCallCost - Assumed cost of a call into an extern.
+static const double ExternCallCost = 50;
+
+/// EstimateCost - Rough number of node evaluations needed to evaluate `expr`,
+/// given the estimated cost of every function it may call.
+double EstimateCost(const ExprAST& expr, const std::vector<double>& functionCosts)
+{
+    double cost = 1;
+    switch (expr.getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        break;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        cost += EstimateCost(bin.getLHS(), functionCosts) + EstimateCost(bin.getRHS(), functionCosts);
+        break;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        cost += functionCosts[call.getSlot()];
+        for (const auto& arg : call.getArgs())
+            cost += EstimateCost(*arg, functionCosts);
+        break;
+    }
+    }
+    return cost < CostUnbounded ? cost : CostUnbounded;
+}
+
+/// ComputeFunctionCosts - Estimate the cost of one call to each function in
+/// `functions` into `costs`, given every function's body by slot index (null
+/// for an extern). The other entries of `costs` are taken as final. Anything
+/// on a call cycle is CostUnbounded.
+void ComputeFunctionCosts(const std::vector<const ExprAST *>& bodies, const std::vector<unsigned>& functions,
+                          std::vector<double>& costs)
+{
+    enum VisitState { unvisited, visiting, visited };
+    std::vector<VisitState> state(bodies.size(), visited);
+    for (unsigned f : functions)
+        state[f] = unvisited;
+
+    std::function<void(unsigned)> visit = [&](unsigned f) {
+        state[f] = visiting;
+        double cost = ExternCallCost;
+        if (bodies[f])
+        {
+            std::vector<unsigned> callees;
+            CollectCallees(*bodies[f], callees);
+            bool recursive = false;
+            for (unsigned callee : callees)
+            {
+                if (state[callee] == unvisited)
+                    visit(callee);
+                else if (state[callee] == visiting)
+                    recursive = true;
+            }
+            cost = recursive ? CostUnbounded : EstimateCost(*bodies[f], costs);
+        }
+        costs[f] = cost;
+        state[f] = visited;
+    };
+    for (unsigned f : functions)
+        if (state[f] == unvisited)
+            visit(f);
+}
+
+/// StronglyConnectedComponents - Tarjan's algorithm over a call graph given as
+/// the callees of each node. Components come out callee-first: each one is
+/// listed after every component it calls into. Iterative, since call chains
+/// in a large module run deeper than the native stack.
+std::vector<std::vector<unsigned> > StronglyConnectedComponents(const std::vector<std::vector<unsigned> >& callees)
+{
+    const unsigned unvisited = ~0u;
+    size_t n = callees.size();
+    std::vector<unsigned> index(n, unvisited), lowlink(n, 0);
+    std::vector<bool> onStack(n, false);
+    std::vector<unsigned> stack;
+    std::vector<std::pair<unsigned, size_t> > frames; // node, next callee to visit
+    std::vector<std::vector<unsigned> > components;
+    unsigned counter = 0;
+
+    auto enter = [&](unsigned v) {
+        index[v] = lowlink[v] = counter++;
+        stack.push_back(v);
+        onStack[v] = true;
+        frames.push_back({v, 0});
+    };
+
+    for (unsigned root = 0; root < n; ++root)
+    {
+        if (index[root] != unvisited)
+            continue;
+        enter(root);
+        while (!frames.empty())
+        {
+            unsigned v = frames.back().first;
+            if (frames.back().second < callees[v].size())
+            {
+                unsigned w = callees[v][frames.back().second++];
+                if (index[w] == unvisited)
+                    enter(w);
+                else if (onStack[w])
+                    lowlink[v] = std::min(lowlink[v], index[w]);
+                continue;
+            }
+
+            frames.pop_back();
+            if (!frames.empty())
+            {
+                unsigned caller = frames.back().first;
+                lowlink[caller] = std::min(lowlink[caller], lowlink[v]);
+            }
+            if (lowlink[v] != index[v])
+                continue;
+            components.emplace_back();
+            unsigned w;
+            do
+            {
+                w = stack.back();
+                stack.pop_back();
+                onStack[w] = false;
+                components.back().push_back(w);
+            } while (w != v);
+        }
+    }
+    return components;
+}
+
+#endif
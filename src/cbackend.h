@@ -0,0 +1,606 @@
+// C backend
+
+#ifndef CBACKEND_H
+#define CBACKEND_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "codecache.h"
+#include "codememory.h"
+#include "inliner.h"
+#include "interpreter.h"
+#include "ir.h"
+#include "sharedcache.h"
+#include "threadpool.h"
+
+extern char **environ;
+
+// Compiles the function table by printing each function's optimized IR as C
+// and handing the file to the system C compiler. Every def becomes a C
+// function of doubles with the same name after EmitPrefix, and every extern
+// becomes an extern C declaration, so the output follows the platform's C ABI. The same module can
+// be written out ahead of time (CompileModuleAOT) or built with the defs
+// private and loaded back into this process (CompileNativeModule).
+
+/// CCompiler - The compiler to run; $CC overrides it.
+static std::string CCompiler = getenv("CC") ? getenv("CC") : "cc";
+
+/// IsCKeyword - Names that cannot be used as C identifiers.
+bool IsCKeyword(const std::string& name)
+{
+    static const char *keywords[] = {
+        "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum",
+        "extern", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return",
+        "short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+        "volatile", "while",
+    };
+    for (const char *keyword : keywords)
+        if (name == keyword)
+            return true;
+    return false;
+}
+
+/// EmitPrefix - Prepended to the C name of every def, so that an exported def
+/// cannot take the place of a C library function of the same name.
+static std::string EmitPrefix;
+
+/// CSymbolName - The C name of `slot`: an extern's own, or a def's SymbolName
+/// after EmitPrefix.
+std::string CSymbolName(const FunctionSlot& slot)
+{
+    return slot.isExtern ? SymbolName(slot) : EmitPrefix + SymbolName(slot);
+}
+
+/// IsSystemSymbol - Whether a module exporting `name` would break linking or
+/// interpose on the C runtime: main, or anything libc or libm defines.
+bool IsSystemSymbol(const std::string& name)
+{
+    static void *libm = dlopen("libm.so.6", RTLD_LAZY);
+    return name == "main" || dlsym(RTLD_DEFAULT, name.c_str()) || (libm && dlsym(libm, name.c_str()));
+}
+
+/// EmitCConstant - Print `value` as a C expression with exactly that value.
+void EmitCConstant(FILE *out, double value)
+{
+    if (std::isnan(value))
+        fprintf(out, "(0.0 / 0.0)");
+    else if (std::isinf(value))
+        fprintf(out, value > 0 ? "(1.0 / 0.0)" : "(-1.0 / 0.0)");
+    else
+        fprintf(out, "%a", value); // hex float, so no digits are lost
+}
+
+/// EmitCPrototype - Print "double name(double _a0, ...)". Generated names
+/// start with an underscore, which no Kaleidoscope identifier can, so that
+/// they never shadow a def of the same name.
+void EmitCPrototype(FILE *out, const std::string& name, size_t arity, bool withNames)
+{
+    fprintf(out, "double %s(", name.c_str());
+    for (size_t i = 0; i < arity; ++i)
+        fprintf(out, withNames ? "%sdouble _a%zu" : "%sdouble", i ? ", " : "", i);
+    if (arity == 0)
+        fprintf(out, "void");
+    fprintf(out, ")");
+}
+
+/// EmitCBody - Print the statements of an IR function, one const per value.
+void EmitCBody(FILE *out, const IRFunction& function)
+{
+    for (unsigned i = 0; i < function.insts.size(); ++i)
+    {
+        const IRInst& inst = function.insts[i];
+        const std::vector<unsigned>& ops = inst.operands;
+        fprintf(out, "    const double _v%u = ", i);
+        switch (inst.op)
+        {
+        case ir_const:
+            EmitCConstant(out, inst.value);
+            break;
+        case ir_arg:
+            fprintf(out, "_a%u", inst.index);
+            break;
+        case ir_add:
+            fprintf(out, "_v%u + _v%u", ops[0], ops[1]);
+            break;
+        case ir_sub:
+            fprintf(out, "_v%u - _v%u", ops[0], ops[1]);
+            break;
+        case ir_mul:
+            fprintf(out, "_v%u * _v%u", ops[0], ops[1]);
+            break;
+        case ir_lt:
+            fprintf(out, "_v%u < _v%u ? 1.0 : 0.0", ops[0], ops[1]);
+            break;
+        case ir_copy:
+            fprintf(out, "_v%u", ops[0]);
+            break;
+        case ir_call:
+            fprintf(out, "%s(", CSymbolName(*FunctionSlots[inst.index]).c_str());
+            for (size_t k = 0; k < ops.size(); ++k)
+                fprintf(out, "%s_v%u", k ? ", " : "", ops[k]);
+            fprintf(out, ")");
+            break;
+        }
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "    return _v%u;\n", function.result);
+}
+
+/// NativeEntryPrefix - Prefix of the NativeEntry thunk exported for each def
+/// when a module is built for loading into this process.
+static const char *NativeEntryPrefix = "kaleidoscope_entry_";
+
+/// NativeImportPrefix - Prefix of the pointer through which a module calls a
+/// def it imports from an earlier module, set once the module is loaded.
+static const char *NativeImportPrefix = "kaleidoscope_import_";
+
+/// CallClosure - `roots` and every function they can reach through calls, in
+/// slot order. Functions flagged in `imported` are included, but not what
+/// they call.
+std::vector<unsigned> CallClosure(const std::vector<unsigned>& roots, const std::vector<bool> *imported = nullptr)
+{
+    std::vector<bool> seen(FunctionSlots.size(), false);
+    std::vector<unsigned> worklist;
+    for (unsigned root : roots)
+    {
+        if (!seen[root])
+            worklist.push_back(root);
+        seen[root] = true;
+    }
+    while (!worklist.empty())
+    {
+        const FunctionSlot& slot = *FunctionSlots[worklist.back()];
+        worklist.pop_back();
+        if (slot.isExtern || (imported && (*imported)[slot.index]))
+            continue;
+        std::vector<unsigned> callees;
+        CollectCallees(slot.definition->getBody(), callees);
+        for (unsigned callee : callees)
+        {
+            if (!seen[callee])
+                worklist.push_back(callee);
+            seen[callee] = true;
+        }
+    }
+    std::vector<unsigned> closure;
+    for (unsigned i = 0; i < seen.size(); ++i)
+        if (seen[i])
+            closure.push_back(i);
+    return closure;
+}
+
+/// AllDefinitions - Slot index of every parsed def (not extern) in the table,
+/// apart from other sessions' private ones.
+std::vector<unsigned> AllDefinitions()
+{
+    std::vector<unsigned> defs;
+    for (const auto& slot : FunctionSlots)
+        if (slot->definition && (!slot->session || slot->session == CurrentSession))
+            defs.push_back(slot->index);
+    return defs;
+}
+
+/// EmitCModule - Write the given slots, which must be closed under calls, to
+/// `out` as one C translation unit. `linkage` prefixes each definition, e.g.
+/// "" to export them or "static inline" to keep them private. With
+/// `entryPoints`, each def also gets an exported NativeEntry thunk. Given
+/// `definedHere`, only the defs it flags get a body; the rest are declared
+/// extern, to be supplied by another unit linked into the same object. Defs
+/// flagged in `imported` get a private wrapper that calls through the
+/// NativeImportPrefix pointer, which the loader sets. An exported def may not
+/// clash with the C runtime, see IsSystemSymbol.
+bool EmitCModule(FILE *out, const std::vector<unsigned>& slots, const char *linkage, bool entryPoints,
+                 const std::vector<bool> *definedHere = nullptr, const std::vector<bool> *imported = nullptr)
+{
+    for (unsigned index : slots)
+    {
+        const FunctionSlot& slot = *FunctionSlots[index];
+        std::string name = CSymbolName(slot);
+        if (IsCKeyword(name))
+            return LogErrorR("Function name '" + name + "' is a C keyword");
+        if (!*linkage && !slot.isExtern && IsSystemSymbol(name))
+            return LogErrorR("Function name '" + name + "' clashes with the C library; rename it or set --emit-prefix");
+    }
+
+    fprintf(out, "/* Generated by the Kaleidoscope C backend. */\n\n");
+    for (unsigned index : slots)
+    {
+        const auto& slot = FunctionSlots[index];
+        if (imported && (*imported)[index])
+        {
+            // Weak, so that every shard of a split module may define it.
+            fprintf(out, "__attribute__((weak)) double (*%s%s)(const double *);\nstatic inline ", NativeImportPrefix,
+                    SymbolName(*slot).c_str());
+            EmitCPrototype(out, CSymbolName(*slot), slot->arity, false);
+            fprintf(out, ";\n");
+            continue;
+        }
+        if (slot->isExtern || (definedHere && !(*definedHere)[index]))
+            fprintf(out, "extern ");
+        if (!slot->isExtern && *linkage)
+            fprintf(out, "%s ", linkage);
+        EmitCPrototype(out, CSymbolName(*slot), slot->arity, false);
+        fprintf(out, ";\n");
+    }
+
+    for (unsigned index : slots)
+    {
+        const auto& slot = FunctionSlots[index];
+        if (imported && (*imported)[index])
+        {
+            fprintf(out, "\nstatic inline ");
+            EmitCPrototype(out, CSymbolName(*slot), slot->arity, true);
+            fprintf(out, "\n{\n");
+            if (slot->arity == 0)
+                fprintf(out, "    return %s%s(0);\n", NativeImportPrefix, SymbolName(*slot).c_str());
+            else
+            {
+                fprintf(out, "    const double _args[] = {");
+                for (size_t i = 0; i < slot->arity; ++i)
+                    fprintf(out, "%s_a%zu", i ? ", " : "", i);
+                fprintf(out, "};\n    return %s%s(_args);\n", NativeImportPrefix, SymbolName(*slot).c_str());
+            }
+            fprintf(out, "}\n");
+            continue;
+        }
+        if (slot->isExtern || (definedHere && !(*definedHere)[index]))
+            continue;
+        IRFunction ir = slot->ir ? *slot->ir : LowerToIR(slot->name, slot->arity, slot->definition->getBody());
+        fprintf(out, "\n");
+        if (*linkage)
+            fprintf(out, "%s ", linkage);
+        EmitCPrototype(out, CSymbolName(*slot), slot->arity, true);
+        fprintf(out, "\n{\n");
+        EmitCBody(out, ir);
+        fprintf(out, "}\n");
+
+        if (entryPoints)
+        {
+            fprintf(out, "double %s%s(const double *_args)\n{\n    return %s(", NativeEntryPrefix,
+                    SymbolName(*slot).c_str(), CSymbolName(*slot).c_str());
+            for (size_t i = 0; i < slot->arity; ++i)
+                fprintf(out, "%s_args[%zu]", i ? ", " : "", i);
+            fprintf(out, ");\n}\n");
+        }
+    }
+    return true;
+}
+
+/// RunCommand - Run argv[0] with the given arguments and wait for it.
+bool RunCommand(const std::vector<std::string>& args)
+{
+    std::vector<char *> argv;
+    for (const std::string& arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+        return LogErrorR("Cannot run '" + args[0] + "'");
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return LogErrorR("'" + args[0] + "' failed");
+    return true;
+}
+
+/// NativeLinkFlags - How modules loaded into this process are linked, for
+/// LoadCodeImage: without the start files, whose constructors it does not
+/// run, and with the segments packed onto as few pages as possible. It seals
+/// the whole module read-only, so there is no point in RELRO.
+static const std::vector<std::string> NativeLinkFlags = {"-nostartfiles", "-Wl,-z,noseparate-code",
+                                                         "-Wl,-z,norelro", "-Wl,-z,max-page-size=4096"};
+
+/// CompileC - Compile the C file at `source` into `output`: a relocatable
+/// object if `output` ends in ".o", otherwise a shared object. Floating-point
+/// contraction is off so that results match the interpreter bit for bit.
+/// Without errno, calls to sqrt, fabs and the like become single instructions.
+/// A shared object to be loaded into this process is linked with
+/// NativeLinkFlags.
+bool CompileC(const std::string& source, const std::string& output, const char *optLevel, bool native = false)
+{
+    bool object = output.size() > 2 && output.compare(output.size() - 2, 2, ".o") == 0;
+    std::vector<std::string> args = {CCompiler, optLevel, "-fPIC", "-ffp-contract=off", "-fno-math-errno", "-w"};
+    if (object)
+        args.push_back("-c");
+    else
+        args.push_back("-shared");
+    if (!object && native)
+        args.insert(args.end(), NativeLinkFlags.begin(), NativeLinkFlags.end());
+    args.insert(args.end(), {"-o", output, source});
+    if (!object)
+        args.push_back("-lm");
+    return RunCommand(args);
+}
+
+/// CompileModuleAOT - Compile every def seen so far into `output`, exporting
+/// each one under its own name after EmitPrefix with the C calling convention. An output ending
+/// in ".c" just receives the generated source.
+bool CompileModuleAOT(const std::string& output)
+{
+    bool sourceOnly = output.size() > 2 && output.compare(output.size() - 2, 2, ".c") == 0;
+    std::string source = sourceOnly ? output : output + ".c";
+
+    FILE *out = fopen(source.c_str(), "w");
+    if (!out)
+        return LogErrorR("Cannot write '" + source + "'");
+    MaterializeAll();
+    PrepareForEvaluation();
+    bool ok = EmitCModule(out, CallClosure(AllDefinitions()), "", false);
+    ok = fclose(out) == 0 && ok;
+    if (!ok || sourceOnly)
+        return ok;
+
+    ok = CompileC(source, output, "-O2");
+    remove(source.c_str());
+    return ok;
+}
+
+/// NativeModuleDir - Scratch directory for modules built for this process,
+/// created on first use and removed at exit.
+struct NativeModuleDir
+{
+    std::string path;
+    ~NativeModuleDir()
+    {
+        if (!path.empty())
+            rmdir(path.c_str());
+    }
+};
+static NativeModuleDir ModuleDir;
+/// NativeModulesBuilt - Modules built so far, to name their files.
+static unsigned NativeModulesBuilt = 0;
+
+/// NativeFlags - Optimization level for modules loaded into this process.
+static const char *NativeFlags = "-O3";
+/// ShardMinNodes - Least code, in AST nodes, worth a compiler process of its
+/// own when a native module is split.
+static const unsigned ShardMinNodes = 2000;
+/// ShardLinkage - Linkage of the defs in a split module: visible to the other
+/// shards linked into the same object, but not exported from it.
+static const char *ShardLinkage = "__attribute__((visibility(\"hidden\")))";
+
+/// PartitionModule - Split `defs` into at most `count` shards of similar size
+/// in AST nodes. The defs are taken one strongly connected component at a
+/// time in callee-first order, so mutually recursive defs share a shard and
+/// most calls stay within a shard, where the compiler can still inline them.
+std::vector<std::vector<unsigned> > PartitionModule(const std::vector<unsigned>& defs, unsigned count)
+{
+    std::map<unsigned, unsigned> position;
+    for (unsigned i = 0; i < defs.size(); ++i)
+        position[defs[i]] = i;
+    std::vector<std::vector<unsigned> > callees(defs.size());
+    std::vector<unsigned> weight(defs.size());
+    unsigned total = 0;
+    for (unsigned i = 0; i < defs.size(); ++i)
+    {
+        const ExprAST& body = FunctionSlots[defs[i]]->definition->getBody();
+        std::vector<unsigned> calls;
+        CollectCallees(body, calls);
+        for (unsigned callee : calls)
+            if (position.count(callee))
+                callees[i].push_back(position[callee]);
+        weight[i] = CountNodes(body);
+        total += weight[i];
+    }
+
+    std::vector<std::vector<unsigned> > shards(1);
+    unsigned filled = 0;
+    for (const std::vector<unsigned>& component : StronglyConnectedComponents(callees))
+    {
+        for (unsigned member : component)
+        {
+            shards.back().push_back(defs[member]);
+            filled += weight[member];
+        }
+        if (shards.size() < count && filled >= (uint64_t)total * shards.size() / count)
+            shards.emplace_back();
+    }
+    if (shards.back().empty())
+        shards.pop_back();
+    return shards;
+}
+
+/// BuildShardedModule - Build the shared object `output` from `shards` of a
+/// module, one compiler process per shard on CompileThreads threads, then
+/// link the objects. Each shard declares just the defs it calls into.
+bool BuildShardedModule(const std::vector<std::vector<unsigned> >& shards, const std::vector<bool>& imported,
+                        const std::string& base, const std::string& output)
+{
+    std::vector<std::string> objects(shards.size());
+    std::vector<char> built(shards.size(), 0);
+    ThreadPool compilePool(std::min<unsigned>(CompileThreads, shards.size()));
+    compilePool.parallelFor(shards.size(), [&](size_t i) {
+        std::vector<bool> definedHere(FunctionSlots.size(), false);
+        std::set<unsigned> declared;
+        for (unsigned index : shards[i])
+        {
+            definedHere[index] = true;
+            declared.insert(index);
+            std::vector<unsigned> calls;
+            CollectCallees(FunctionSlots[index]->definition->getBody(), calls);
+            declared.insert(calls.begin(), calls.end());
+        }
+
+        std::string source = base + "-" + std::to_string(i) + ".c";
+        objects[i] = base + "-" + std::to_string(i) + ".o";
+        FILE *out = fopen(source.c_str(), "w");
+        if (!out)
+        {
+            LogErrorR("Cannot write '" + source + "'");
+            return;
+        }
+        std::vector<unsigned> slots(declared.begin(), declared.end());
+        bool ok = EmitCModule(out, slots, ShardLinkage, true, &definedHere, &imported);
+        ok = fclose(out) == 0 && ok;
+        built[i] = ok && CompileC(source, objects[i], NativeFlags);
+        remove(source.c_str());
+    });
+
+    bool ok = std::find(built.begin(), built.end(), 0) == built.end();
+    if (ok)
+    {
+        std::vector<std::string> args = {CCompiler, "-shared"};
+        args.insert(args.end(), NativeLinkFlags.begin(), NativeLinkFlags.end());
+        args.insert(args.end(), {"-o", output});
+        args.insert(args.end(), objects.begin(), objects.end());
+        args.push_back("-lm");
+        ok = RunCommand(args);
+    }
+    for (const std::string& object : objects)
+        remove(object.c_str());
+    return ok;
+}
+
+/// CompileNativeModule - Build `roots` and everything they call into a shared
+/// object with the C compiler at -O3, load it, and point each of those slots
+/// that is not ready yet at its entry thunk. The defs are static inline, so
+/// calls between them are direct and can be inlined; only the thunks are
+/// exported. A module too large for one compiler to get through quickly is
+/// split by PartitionModule and built by BuildShardedModule instead. With a
+/// code cache configured, an identical module built earlier, by this or any
+/// previous process, is loaded instead of compiling. The module is loaded into
+/// code memory (codememory.h) and unloaded with the last version that runs it.
+/// On failure the slots are left for the IR interpreter. Called with
+/// TableMutex held.
+///
+/// With `importBuilt`, a callee outside `roots` that already has native code
+/// is not compiled again: the module calls it through its entry thunk in the
+/// module that has it. That gives up inlining it, but keeps a module built
+/// for a batch of new defs from growing with everything they reach.
+bool CompileNativeModule(const std::vector<unsigned>& roots, bool importBuilt)
+{
+    std::vector<bool> imported(FunctionSlots.size(), false);
+    if (importBuilt)
+    {
+        for (const auto& slot : FunctionSlots)
+            imported[slot->index] = !slot->isExtern && slot->native;
+        for (unsigned root : roots)
+            imported[root] = false;
+    }
+    std::vector<unsigned> members = CallClosure(roots, &imported);
+    std::vector<unsigned> defs;
+    for (unsigned index : members)
+        if (!imported[index] && !FunctionSlots[index]->isExtern)
+            defs.push_back(index);
+
+    std::string library;
+    bool cached = false;
+    SharedCacheEntry *claim = nullptr;
+    if (!CodeCacheDir.empty() && EnsureDirectory(CodeCacheDir))
+    {
+        StructuralHash key = ModuleCacheKey(members, imported, TargetDescription(CCompiler, NativeFlags));
+        library = CodeCachePath(key.hex());
+        cached = AwaitModule(key, library, claim);
+    }
+
+    if (!cached)
+    {
+        std::string base;
+        if (!library.empty())
+            base = CodeCacheDir + "/tmp-" + std::to_string(getpid()) + "-" + std::to_string(NativeModulesBuilt++);
+        else
+        {
+            if (ModuleDir.path.empty())
+            {
+                char dir[] = "/tmp/kaleidoscope-XXXXXX";
+                if (!mkdtemp(dir))
+                    return LogErrorR("Cannot create a directory for native modules");
+                ModuleDir.path = dir;
+            }
+            base = ModuleDir.path + "/module" + std::to_string(NativeModulesBuilt++);
+        }
+        std::string source = base + ".c", built = base + ".so";
+
+        // A large module is split so that several compilers work on it.
+        unsigned nodes = 0;
+        for (unsigned index : defs)
+            nodes += CountNodes(FunctionSlots[index]->definition->getBody());
+        unsigned numShards = std::min<unsigned>(CompileThreads, nodes / ShardMinNodes);
+        bool ok;
+        if (numShards > 1)
+            ok = BuildShardedModule(PartitionModule(defs, numShards), imported, base, built);
+        else
+        {
+            FILE *out = fopen(source.c_str(), "w");
+            if (!out)
+            {
+                ReleaseModule(claim);
+                return LogErrorR("Cannot write '" + source + "'");
+            }
+            ok = EmitCModule(out, members, "static inline", true, nullptr, &imported);
+            ok = fclose(out) == 0 && ok;
+            ok = ok && CompileC(source, built, NativeFlags, true);
+            remove(source.c_str());
+        }
+        if (!ok)
+        {
+            remove(built.c_str());
+            ReleaseModule(claim);
+            return false;
+        }
+
+        if (library.empty())
+            library = built;
+        else if (rename(built.c_str(), library.c_str()) != 0)
+        {
+            // Publish atomically, so other processes never see a partial file.
+            remove(built.c_str());
+            ReleaseModule(claim);
+            return LogErrorR("Cannot store '" + library + "' in the code cache");
+        }
+        ReleaseModule(claim);
+    }
+
+    // The module calls what it imports through pointers set as it is loaded,
+    // and keeps the modules those point into loaded.
+    std::vector<std::pair<std::string, void *> > presets;
+    std::vector<std::shared_ptr<NativeModule> > importedModules;
+    for (unsigned index : members)
+    {
+        if (!imported[index])
+            continue;
+        const FunctionSlot& slot = *FunctionSlots[index];
+        presets.push_back({NativeImportPrefix + SymbolName(slot), (void *)slot.native});
+        importedModules.push_back(slot.nativeModule);
+    }
+    std::shared_ptr<NativeModule> module = LoadNativeModule(library, presets);
+    // Without a cache the file stays mapped, or has been copied. A cached one
+    // that does not load is damaged, and must not be found again.
+    if (CodeCacheDir.empty() || !module)
+        remove(library.c_str());
+    if (!module && cached)
+        return CompileNativeModule(roots, importBuilt); // build it afresh
+    if (!module)
+        return false;
+    module->imports = std::move(importedModules);
+
+    for (unsigned index : defs)
+    {
+        FunctionSlot& slot = *FunctionSlots[index];
+        if (slot.ready)
+            continue; // keep the code its current version already has
+        slot.native = (NativeEntry)module->lookup(NativeEntryPrefix + SymbolName(slot));
+        if (slot.native)
+        {
+            slot.nativeModule = module;
+            slot.ready = true;
+            PublishVersion(slot);
+        }
+    }
+    return true;
+}
+
+#endif
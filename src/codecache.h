@@ -0,0 +1,208 @@
+// Persistent compiled-code cache
+
+#ifndef CODECACHE_H
+#define CODECACHE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "ast.h"
+#include "callgraph.h"
+#include "interpreter.h"
+
+// Compiled modules are stored in a local directory under a name derived from
+// what went into them: the structure of every function and everything it
+// calls, the backend version, the compiler and the CPU. A process that
+// rebuilds an identical module loads the stored shared object instead of
+// running the compiler. The dynamic loader maps it straight from the cache.
+
+/// CodeCacheDir - Directory holding cached modules; empty disables the cache.
+static std::string CodeCacheDir;
+/// CodeCacheVersion - Bump whenever the generated code changes for the same
+/// input, so stale entries stop matching.
+static const char *CodeCacheVersion = "kaleidoscope-c-3";
+
+/// StructuralHash - A 128-bit hash built from a stream of words, wide enough
+/// that distinct modules never share a cache entry in practice.
+struct StructuralHash
+{
+    uint64_t lo = 0x6a09e667f3bcc908ull;
+    uint64_t hi = 0xbb67ae8584caa73bull;
+
+    static uint64_t Mix(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    void add(uint64_t word)
+    {
+        lo = Mix(lo ^ word);
+        hi = Mix(hi + word * 0xff51afd7ed558ccdull);
+    }
+
+    void add(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        add(bits);
+    }
+
+    void add(const std::string& str)
+    {
+        add((uint64_t)str.size());
+        for (unsigned char c : str)
+            add((uint64_t)c);
+    }
+
+    void add(const StructuralHash& other)
+    {
+        add(other.lo);
+        add(other.hi);
+    }
+
+    std::string hex() const
+    {
+        char buffer[33];
+        snprintf(buffer, sizeof(buffer), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+        return buffer;
+    }
+};
+
+/// HashExpr - Feed the shape of a resolved expression into `hash`. Calls
+/// contribute the callee's SymbolName and arity, not its slot index, so the
+/// hash does not depend on declaration order.
+void HashExpr(const ExprAST& expr, StructuralHash& hash)
+{
+    hash.add((uint64_t)expr.getKind());
+    switch (expr.getKind())
+    {
+    case expr_number:
+        hash.add(static_cast<const NumberExprAST&>(expr).getValue());
+        return;
+    case expr_variable:
+        hash.add((uint64_t) static_cast<const VariableExprAST&>(expr).getIndex());
+        return;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        hash.add((uint64_t)(unsigned char)bin.getOp());
+        HashExpr(bin.getLHS(), hash);
+        HashExpr(bin.getRHS(), hash);
+        return;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        hash.add(SymbolName(*FunctionSlots[call.getSlot()]));
+        hash.add((uint64_t)call.getArgs().size());
+        for (const auto& arg : call.getArgs())
+            HashExpr(*arg, hash);
+        return;
+    }
+    }
+}
+
+/// LocalHash - Hash of one slot on its own: name, arity, and body or extern.
+StructuralHash LocalHash(const FunctionSlot& slot)
+{
+    StructuralHash hash;
+    hash.add(SymbolName(slot));
+    hash.add((uint64_t)slot.arity);
+    hash.add((uint64_t)slot.isExtern);
+    if (!slot.isExtern)
+        HashExpr(slot.definition->getBody(), hash);
+    return hash;
+}
+
+/// TargetDescription - The parts of the build environment that change the
+/// generated machine code: compiler, flags, architecture and CPU features.
+std::string TargetDescription(const std::string& compiler, const char *flags)
+{
+    std::string description = std::string(CodeCacheVersion) + ";" + compiler + ";" + flags;
+    struct utsname name;
+    if (uname(&name) == 0)
+        description += std::string(";") + name.sysname + ";" + name.machine;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        description += ";sse4.2";
+    if (__builtin_cpu_supports("avx"))
+        description += ";avx";
+    if (__builtin_cpu_supports("avx2"))
+        description += ";avx2";
+    if (__builtin_cpu_supports("fma"))
+        description += ";fma";
+    if (__builtin_cpu_supports("avx512f"))
+        description += ";avx512f";
+#endif
+    return description;
+}
+
+/// ModuleCacheKey - Cache key for a module holding `members`, a call closure
+/// that stops at the `imported` slots. Each member goes in once, by its
+/// LocalHash; an imported one only by name and arity, since the module calls
+/// whatever code it has instead of holding a copy of its body.
+StructuralHash ModuleCacheKey(const std::vector<unsigned>& members, const std::vector<bool>& imported,
+                              const std::string& target)
+{
+    std::vector<std::pair<std::string, unsigned> > sorted;
+    for (unsigned slot : members)
+        sorted.push_back({SymbolName(*FunctionSlots[slot]), slot});
+    std::sort(sorted.begin(), sorted.end());
+
+    StructuralHash hash;
+    hash.add(target);
+    for (const auto& member : sorted)
+    {
+        const FunctionSlot& slot = *FunctionSlots[member.second];
+        hash.add((uint64_t)imported[slot.index]);
+        if (imported[slot.index])
+        {
+            hash.add(member.first);
+            hash.add((uint64_t)slot.arity);
+        }
+        else
+            hash.add(LocalHash(slot));
+    }
+    return hash;
+}
+
+/// EnsureDirectory - Create `path` and its parents if needed.
+bool EnsureDirectory(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+    {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+            return LogErrorR("Cannot create directory '" + prefix + "'");
+        if (slash == std::string::npos)
+            return true;
+    }
+}
+
+/// CodeCachePath - Where the module with `key` lives in the cache.
+std::string CodeCachePath(const std::string& key)
+{
+    return CodeCacheDir + "/" + key + ".so";
+}
+
+/// FileExists - Whether something exists at `path`.
+bool FileExists(const std::string& path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+#endif
@@ -0,0 +1,457 @@
+// Executable memory for native modules
+
+#ifndef CODEMEMORY_H
+#define CODEMEMORY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ffi.h"
+#include "interpreter.h"
+
+// dlopen maps every native module on its own pages, four or five mappings
+// each, and never gives them back, so a session that builds many small
+// modules spends a page of iTLB reach per function and keeps the code of
+// every def it ever replaced. Instead, CompileNativeModule loads its shared
+// objects itself (LoadCodeImage): each goes into a slab carved from a few
+// large code arenas, is relocated while the slab is writable, and is then
+// sealed read-only and executable with a single mprotect. Generated modules
+// write nothing after loading (the loader fills in their import pointers), so
+// no page is ever writable and executable at once, and protections change
+// per module rather than per function. A slab is freed when the last version
+// that runs its code is retired, see NativeModule.
+//
+// Arenas start out, and freed slabs return to, read-only and executable and
+// full of zeros, so that sealed slabs next to each other merge with the space
+// around them into one mapping. With HugeCodePages the arenas are aligned to
+// and sized in 2 MB and the kernel is asked to back them with huge pages;
+// freed slabs then keep their pages rather than splitting one.
+//
+// An image the loader does not understand (constructors, TLS, another
+// architecture) is handed to dlopen as before.
+
+/// CodeArenaBytes - Size and alignment of a code arena, a huge page. A module
+/// larger than that gets an arena of its own.
+static const size_t CodeArenaBytes = 2u << 20;
+/// HugeCodePages - Ask for huge pages behind the code arenas.
+static bool HugeCodePages = false;
+
+/// CodeArena - One mapping that slabs are carved from, and the runs of it that
+/// are free, as offset and length.
+struct CodeArena
+{
+    char *base;
+    size_t size;
+    std::map<size_t, size_t> free;
+};
+
+/// CodeMemoryMutex - Guards the arenas. Slabs are freed by whichever thread
+/// reclaims the last version using them.
+static std::mutex CodeMemoryMutex;
+/// CodeArenas - Never destroyed, since the function table that holds the
+/// modules is destroyed after it at exit.
+static std::vector<CodeArena>& CodeArenas = *new std::vector<CodeArena>;
+
+/// CodePageSize - The granularity of protections, and so of slabs.
+size_t CodePageSize()
+{
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/// CodeSlab - A run of whole pages within an arena.
+struct CodeSlab
+{
+    char *address = nullptr;
+    size_t size = 0;
+};
+
+/// MapCodeArena - Map a new arena of at least `size` bytes, aligned to
+/// CodeArenaBytes. Called with CodeMemoryMutex held.
+CodeArena *MapCodeArena(size_t size)
+{
+    size = (size + CodeArenaBytes - 1) / CodeArenaBytes * CodeArenaBytes;
+    // Over-allocate, then trim to the alignment.
+    size_t mapped = size + CodeArenaBytes;
+    void *region = mmap(nullptr, mapped, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+        return nullptr;
+    char *start = static_cast<char *>(region);
+    char *base = reinterpret_cast<char *>(((uintptr_t)start + CodeArenaBytes - 1) & ~(uintptr_t)(CodeArenaBytes - 1));
+    if (base > start)
+        munmap(start, base - start);
+    if (base + size < start + mapped)
+        munmap(base + size, start + mapped - (base + size));
+#ifdef MADV_HUGEPAGE
+    if (HugeCodePages)
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    CodeArenas.push_back({base, size, {{0, size}}});
+    return &CodeArenas.back();
+}
+
+/// FreeCodeSlab - Return `slab` to its arena, merged with the free runs on
+/// either side. Its pages go back to the kernel, unless that would split a
+/// huge page.
+void FreeCodeSlab(const CodeSlab& slab)
+{
+    if (!slab.address)
+        return;
+    if (!HugeCodePages)
+    {
+        madvise(slab.address, slab.size, MADV_DONTNEED);
+        mprotect(slab.address, slab.size, PROT_READ | PROT_EXEC);
+    }
+    else if (mprotect(slab.address, slab.size, PROT_READ | PROT_EXEC) != 0)
+        return; // still writable: leak it rather than hand it out as code
+
+    std::lock_guard<std::mutex> lock(CodeMemoryMutex);
+    for (CodeArena& arena : CodeArenas)
+    {
+        if (slab.address < arena.base || slab.address >= arena.base + arena.size)
+            continue;
+        size_t offset = slab.address - arena.base, length = slab.size;
+        auto next = arena.free.lower_bound(offset);
+        if (next != arena.free.end() && next->first == offset + length)
+        {
+            length += next->second;
+            next = arena.free.erase(next);
+        }
+        if (next != arena.free.begin())
+        {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == offset)
+            {
+                offset = previous->first;
+                length += previous->second;
+                arena.free.erase(previous);
+            }
+        }
+        arena.free[offset] = length;
+        return;
+    }
+}
+
+/// AllocateCodeSlab - A zeroed, writable slab of at least `size` bytes, first
+/// fit across the arenas. Null if no memory could be mapped.
+CodeSlab AllocateCodeSlab(size_t size)
+{
+    size_t page = CodePageSize();
+    size = (std::max<size_t>(size, 1) + page - 1) / page * page;
+    CodeSlab slab;
+    {
+        std::lock_guard<std::mutex> lock(CodeMemoryMutex);
+        CodeArena *arena = nullptr;
+        std::map<size_t, size_t>::iterator run;
+        for (CodeArena& candidate : CodeArenas)
+        {
+            for (run = candidate.free.begin(); run != candidate.free.end() && run->second < size; ++run)
+                ;
+            if (run != candidate.free.end())
+            {
+                arena = &candidate;
+                break;
+            }
+        }
+        if (!arena)
+        {
+            arena = MapCodeArena(size);
+            if (!arena)
+                return slab;
+            run = arena->free.begin();
+        }
+        size_t offset = run->first, length = run->second;
+        arena->free.erase(run);
+        if (length > size)
+            arena->free[offset + size] = length - size;
+        slab.address = arena->base + offset;
+        slab.size = size;
+    }
+    if (mprotect(slab.address, slab.size, PROT_READ | PROT_WRITE) != 0)
+    {
+        FreeCodeSlab(slab);
+        return CodeSlab();
+    }
+    // Only a slab freed under HugeCodePages can still hold old code.
+    if (HugeCodePages)
+        memset(slab.address, 0, slab.size);
+    return slab;
+}
+
+/// SealCodeSlab - Make `slab` read-only and executable, for good.
+bool SealCodeSlab(const CodeSlab& slab)
+{
+    return mprotect(slab.address, slab.size, PROT_READ | PROT_EXEC) == 0;
+}
+
+/// NativeModule - The code of one loaded module, in a slab or else behind a
+/// dlopen handle, and the modules it calls into. Slots and versions share
+/// ownership of the module their `native` points into, so it is unloaded once
+/// no version can run it any more.
+struct NativeModule
+{
+    CodeSlab slab;
+    void *handle = nullptr;
+    std::map<std::string, void *> symbols; // Exported by LoadCodeImage.
+    std::vector<std::shared_ptr<NativeModule> > imports;
+
+    /// lookup - Address of the exported symbol `name`, or null.
+    void *lookup(const std::string& name) const
+    {
+        if (handle)
+            return dlsym(handle, name.c_str());
+        auto it = symbols.find(name);
+        return it == symbols.end() ? nullptr : it->second;
+    }
+
+    ~NativeModule()
+    {
+        if (handle)
+            dlclose(handle);
+        FreeCodeSlab(slab);
+    }
+};
+
+/// NativeSymbolPrefix - What the names a module exports to the loader start
+/// with; see NativeEntryPrefix and NativeImportPrefix.
+static const char *NativeSymbolPrefix = "kaleidoscope_";
+
+/// LoadCodeImage - Load the x86-64 shared object `image` into a slab of
+/// `module`: copy its segments, apply its relocations and export its
+/// NativeSymbolPrefix symbols. `presets` are pointer variables of the module
+/// to set before it is sealed. Returns false, having allocated nothing, for an
+/// image that needs more than this, such as constructors or thread-local data.
+bool LoadCodeImage(const std::vector<char>& image, const std::vector<std::pair<std::string, void *> >& presets,
+                   NativeModule& module)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    const char *file = image.data();
+    size_t page = CodePageSize();
+    if (image.size() < sizeof(Elf64_Ehdr))
+        return false;
+    const Elf64_Ehdr& header = *reinterpret_cast<const Elf64_Ehdr *>(file);
+    if (memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+        header.e_ident[EI_DATA] != ELFDATA2LSB || header.e_type != ET_DYN || header.e_machine != EM_X86_64 ||
+        header.e_phentsize != sizeof(Elf64_Phdr) || header.e_shentsize != sizeof(Elf64_Shdr) ||
+        header.e_phoff + header.e_phnum * sizeof(Elf64_Phdr) > image.size() ||
+        header.e_shoff + header.e_shnum * sizeof(Elf64_Shdr) > image.size())
+        return false;
+    const Elf64_Phdr *segments = reinterpret_cast<const Elf64_Phdr *>(file + header.e_phoff);
+    const Elf64_Shdr *sections = reinterpret_cast<const Elf64_Shdr *>(file + header.e_shoff);
+
+    uint64_t low = UINT64_MAX, high = 0;
+    const Elf64_Phdr *dynamic = nullptr;
+    for (unsigned i = 0; i < header.e_phnum; ++i)
+    {
+        const Elf64_Phdr& segment = segments[i];
+        if (segment.p_type == PT_TLS || segment.p_type == PT_INTERP)
+            return false;
+        if (segment.p_type == PT_DYNAMIC)
+            dynamic = &segment;
+        if (segment.p_type != PT_LOAD)
+            continue;
+        if (segment.p_align > page || segment.p_filesz > segment.p_memsz ||
+            segment.p_offset + segment.p_filesz > image.size())
+            return false;
+        low = std::min<uint64_t>(low, segment.p_vaddr & ~(uint64_t)(page - 1));
+        high = std::max<uint64_t>(high, segment.p_vaddr + segment.p_memsz);
+    }
+    size_t dynsymCount = 0;
+    for (unsigned i = 0; i < header.e_shnum; ++i)
+        if (sections[i].sh_type == SHT_DYNSYM && sections[i].sh_entsize == sizeof(Elf64_Sym))
+            dynsymCount = sections[i].sh_size / sizeof(Elf64_Sym);
+    if (!dynamic || low >= high || high - low > (1ull << 32))
+        return false;
+
+    // The image is only read from `file` until the segments are copied; the
+    // dynamic section and everything it points to are read from the copy.
+    CodeSlab slab = AllocateCodeSlab(high - low);
+    if (!slab.address)
+        return false;
+    char *base = slab.address - low;
+    for (unsigned i = 0; i < header.e_phnum; ++i)
+        if (segments[i].p_type == PT_LOAD)
+            memcpy(base + segments[i].p_vaddr, file + segments[i].p_offset, segments[i].p_filesz);
+    auto inImage = [&](uint64_t address, uint64_t size) {
+        return size == 0 || (address >= low && address + size <= high);
+    };
+
+    uint64_t symtab = 0, strtab = 0, strsz = 0, rela = 0, relasz = 0, jmprel = 0, pltrelsz = 0;
+    bool supported = inImage(dynamic->p_vaddr, dynamic->p_memsz);
+    for (const Elf64_Dyn *entry = reinterpret_cast<const Elf64_Dyn *>(base + dynamic->p_vaddr);
+         supported && inImage((char *)entry - base, sizeof(Elf64_Dyn)) && entry->d_tag != DT_NULL; ++entry)
+    {
+        switch (entry->d_tag)
+        {
+        case DT_SYMTAB:
+            symtab = entry->d_un.d_ptr;
+            break;
+        case DT_STRTAB:
+            strtab = entry->d_un.d_ptr;
+            break;
+        case DT_STRSZ:
+            strsz = entry->d_un.d_val;
+            break;
+        case DT_RELA:
+            rela = entry->d_un.d_ptr;
+            break;
+        case DT_RELASZ:
+            relasz = entry->d_un.d_val;
+            break;
+        case DT_JMPREL:
+            jmprel = entry->d_un.d_ptr;
+            break;
+        case DT_PLTRELSZ:
+            pltrelsz = entry->d_un.d_val;
+            break;
+        case DT_PLTREL:
+            supported = entry->d_un.d_val == DT_RELA;
+            break;
+        // Code to run at load, or relocations this loader does not apply.
+        case DT_INIT:
+        case DT_INIT_ARRAY:
+        case DT_PREINIT_ARRAY:
+        case DT_TEXTREL:
+        case DT_REL:
+#ifdef DT_RELR
+        case DT_RELR:
+#endif
+            supported = false;
+            break;
+        }
+    }
+    supported = supported && inImage(symtab, dynsymCount * sizeof(Elf64_Sym)) && inImage(strtab, strsz) &&
+                inImage(rela, relasz) && inImage(jmprel, pltrelsz);
+    const Elf64_Sym *symbols = reinterpret_cast<const Elf64_Sym *>(base + symtab);
+    const char *strings = base + strtab;
+
+    // Defined symbols bind within the module; the rest are the externs.
+    auto symbolAddress = [&](uint64_t index, uint64_t& address) {
+        if (index >= dynsymCount || symbols[index].st_name >= strsz)
+            return false;
+        const Elf64_Sym& symbol = symbols[index];
+        if (symbol.st_shndx == SHN_ABS)
+            address = symbol.st_value;
+        else if (symbol.st_shndx != SHN_UNDEF)
+            address = (uint64_t)base + symbol.st_value;
+        else
+        {
+            address = (uint64_t)ResolveExternSymbol(strings + symbol.st_name);
+            return address != 0 || ELF64_ST_BIND(symbol.st_info) == STB_WEAK;
+        }
+        return true;
+    };
+    auto relocate = [&](uint64_t table, uint64_t size) {
+        for (uint64_t at = table; supported && at + sizeof(Elf64_Rela) <= table + size; at += sizeof(Elf64_Rela))
+        {
+            const Elf64_Rela& relocation = *reinterpret_cast<const Elf64_Rela *>(base + at);
+            uint64_t target = 0;
+            if (!inImage(relocation.r_offset, sizeof(uint64_t)))
+            {
+                supported = false;
+                break;
+            }
+            uint64_t *place = reinterpret_cast<uint64_t *>(base + relocation.r_offset);
+            switch (ELF64_R_TYPE(relocation.r_info))
+            {
+            case R_X86_64_NONE:
+                break;
+            case R_X86_64_RELATIVE:
+                *place = (uint64_t)base + relocation.r_addend;
+                break;
+            case R_X86_64_64:
+                supported = symbolAddress(ELF64_R_SYM(relocation.r_info), target);
+                *place = target + relocation.r_addend;
+                break;
+            case R_X86_64_GLOB_DAT:
+            case R_X86_64_JUMP_SLOT:
+                supported = symbolAddress(ELF64_R_SYM(relocation.r_info), target);
+                *place = target;
+                break;
+            default:
+                supported = false;
+                break;
+            }
+        }
+    };
+    if (supported)
+        relocate(rela, relasz);
+    if (supported)
+        relocate(jmprel, pltrelsz);
+
+    std::map<std::string, void *> exported;
+    for (size_t i = 1; supported && i < dynsymCount; ++i)
+    {
+        const Elf64_Sym& symbol = symbols[i];
+        if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= strsz ||
+            strncmp(strings + symbol.st_name, NativeSymbolPrefix, strlen(NativeSymbolPrefix)) != 0)
+            continue;
+        exported[strings + symbol.st_name] = base + symbol.st_value;
+    }
+    for (const auto& preset : presets)
+    {
+        auto it = exported.find(preset.first);
+        if (it == exported.end() || !inImage((char *)it->second - base, sizeof(void *)))
+            supported = false;
+        else
+            *static_cast<void **>(it->second) = preset.second;
+    }
+
+    if (!supported || !SealCodeSlab(slab))
+    {
+        FreeCodeSlab(slab);
+        return false;
+    }
+    module.slab = slab;
+    module.symbols = std::move(exported);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// LoadNativeModule - Load the shared object at `path` with LoadCodeImage, or
+/// else with dlopen, and set its `presets`. Null on failure.
+std::shared_ptr<NativeModule> LoadNativeModule(const std::string& path,
+                                               const std::vector<std::pair<std::string, void *> >& presets)
+{
+    auto module = std::make_shared<NativeModule>();
+    std::vector<char> image;
+    if (FILE *in = fopen(path.c_str(), "rb"))
+    {
+        char buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+            image.insert(image.end(), buffer, buffer + n);
+        fclose(in);
+    }
+    if (LoadCodeImage(image, presets, *module))
+        return module;
+
+    module->handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!module->handle)
+        return LogErrorR(std::string("Cannot load native module: ") + dlerror()), nullptr;
+    for (const auto& preset : presets)
+    {
+        auto *variable = static_cast<void **>(dlsym(module->handle, preset.first.c_str()));
+        if (!variable)
+            return LogErrorR("Native module lacks '" + preset.first + "'"), nullptr;
+        *variable = preset.second;
+    }
+    return module;
+}
+
+#endif
@@ -0,0 +1,170 @@
+// Background compilation
+
+#ifndef COMPILEQUEUE_H
+#define COMPILEQUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "interpreter.h"
+#include "parser.h"
+
+// Installing a def runs the inliner and the AST passes over it, and building
+// its code may run the IR optimizer or the system C compiler, so pasting a
+// large def into the REPL used to hold up the next prompt. Under
+// BackgroundCompilation the REPL only parses: defs and externs go to a queue
+// that one compile thread installs in order, and whenever the queue runs dry
+// that thread goes on to analyse the table and build code for whatever lacks
+// it, a function or a batch (see CompileBatchSize) at a time. A top-level
+// expression waits until everything its session wrote before it has been
+// installed, since it may call any of it, but not for code: a call into a
+// function without code runs on the AST interpreter.
+
+/// QueuedDefinition - A parsed def or extern, the session it was written in,
+/// and whether it was submitted with QuietStatements.
+struct QueuedDefinition
+{
+    TopLevelItem item;
+    Session *session;
+    bool quiet;
+};
+
+/// CompileQueueMutex - Guards everything below; the compile thread holds it
+/// only to take work, never while installing or building.
+static std::mutex CompileQueueMutex;
+static std::condition_variable CompileQueueChanged;
+static std::deque<QueuedDefinition> CompileQueue;
+/// PendingDefinitions - Statements submitted but not installed yet, by the
+/// session they were written in (null for the shared table). A session with
+/// none has no entry, so that none outlives its session.
+static std::map<Session *, size_t> PendingDefinitions;
+/// CodeOutOfDate - Something was installed since the last complete build.
+static bool CodeOutOfDate = false;
+static bool CompileThreadStopping = false;
+static std::thread CompileThread;
+
+/// SubmitDefinition - Queue `item` for the compile thread.
+void SubmitDefinition(TopLevelItem& item)
+{
+    {
+        std::lock_guard<std::mutex> lock(CompileQueueMutex);
+        CompileQueue.push_back({std::move(item), CurrentSession, QuietStatements});
+        ++PendingDefinitions[CurrentSession];
+    }
+    CompileQueueChanged.notify_all();
+}
+
+/// AwaitDefinitions - Wait until everything `session` submitted so far is
+/// installed. Its top-level expressions can only call its own defs and the
+/// shared table, so other sessions' statements are not waited for. A session
+/// is only released after this, since queued statements refer to it.
+void AwaitDefinitions(Session *session)
+{
+    std::unique_lock<std::mutex> lock(CompileQueueMutex);
+    CompileQueueChanged.wait(lock, [session] { return !PendingDefinitions.count(session); });
+}
+
+/// BuildOutOfDateCode - Analyse the table and build code for every function
+/// without it. Takes TableMutex once per function, or once per batch of
+/// CompileBatchSize functions, so that top-level expressions get in between,
+/// and gives up as soon as there is something to install. Returns whether it
+/// got through everything.
+bool BuildOutOfDateCode()
+{
+    std::vector<unsigned> pending;
+    {
+        std::lock_guard<std::recursive_mutex> lock(TableMutex);
+        PrepareForEvaluation();
+        BatchedDefinitions = 0;
+        for (const auto& slot : FunctionSlots)
+            if (slot->definition && !slot->ready)
+                pending.push_back(slot->index);
+    }
+    size_t batchSize = std::max<size_t>(1, CompileBatchSize);
+    for (size_t first = 0; first < pending.size(); first += batchSize)
+    {
+        {
+            std::lock_guard<std::mutex> lock(CompileQueueMutex);
+            if (!CompileQueue.empty() || CompileThreadStopping)
+                return false;
+        }
+        std::lock_guard<std::recursive_mutex> lock(TableMutex);
+        std::vector<unsigned> batch;
+        for (size_t i = first; i < std::min(pending.size(), first + batchSize); ++i)
+        {
+            const FunctionSlot& slot = *FunctionSlots[pending[i]];
+            if (slot.definition && !slot.ready) // may have changed since
+                batch.push_back(pending[i]);
+        }
+        CompileFunctions(batch);
+    }
+    return true;
+}
+
+/// RunCompileThread - Install queued statements in order; build code when
+/// there are none.
+void RunCompileThread()
+{
+    std::unique_lock<std::mutex> lock(CompileQueueMutex);
+    while (true)
+    {
+        CompileQueueChanged.wait(
+            lock, [] { return !CompileQueue.empty() || CodeOutOfDate || CompileThreadStopping; });
+        if (!CompileQueue.empty())
+        {
+            QueuedDefinition next = std::move(CompileQueue.front());
+            CompileQueue.pop_front();
+            lock.unlock();
+            CurrentSession = next.session;
+            QuietStatements = next.quiet;
+            HandleTopLevelItem(next.item);
+            CurrentSession = nullptr;
+            QuietStatements = false;
+            lock.lock();
+            if (--PendingDefinitions[next.session] == 0)
+                PendingDefinitions.erase(next.session);
+            CodeOutOfDate = true;
+            CompileQueueChanged.notify_all();
+        }
+        else if (CompileThreadStopping)
+            return;
+        else
+        {
+            lock.unlock();
+            bool done = BuildOutOfDateCode();
+            lock.lock();
+            if (done && CompileQueue.empty())
+                CodeOutOfDate = false;
+        }
+    }
+}
+
+/// StartBackgroundCompilation - Start the compile thread and route defs to it.
+void StartBackgroundCompilation()
+{
+    CompileThreadStopping = false;
+    CompileThread = std::thread(RunCompileThread);
+    BackgroundCompilation = true;
+}
+
+/// FinishBackgroundCompilation - Install everything still queued and stop the
+/// compile thread. Code not built by then is built on first call, as usual.
+void FinishBackgroundCompilation()
+{
+    if (!BackgroundCompilation)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(CompileQueueMutex);
+        CompileThreadStopping = true;
+    }
+    CompileQueueChanged.notify_all();
+    CompileThread.join();
+    BackgroundCompilation = false;
+}
+
+#endif
@@ -0,0 +1,132 @@
+// Epoch-based reclamation
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Readers walk shared structures without taking a lock, so a writer that
+// unlinks something cannot free it straight away: a reader may still hold it.
+// Readers announce themselves with an EpochGuard, which records the global
+// epoch when they entered. A writer that unlinks an object retires it, tagged
+// with the epoch it was retired in, and advances the epoch. The object is
+// deleted once no thread is inside a guard that it entered at or before that
+// epoch, since every later reader can only have found its replacement.
+
+/// EpochParticipant - One thread's announcement: the epoch it entered its
+/// outermost guard in, or 0 while it holds none.
+struct EpochParticipant
+{
+    std::atomic<uint64_t> epoch{0};
+    unsigned depth = 0; // Nested guards; only the outermost announces.
+};
+
+/// GlobalEpoch - Advanced by every retirement.
+static std::atomic<uint64_t> GlobalEpoch{1};
+/// EpochMutex - Guards the participant list and the retired objects. Readers
+/// take it once per thread, to register; writers take it to retire.
+static std::mutex EpochMutex;
+static std::vector<EpochParticipant *> EpochParticipants;
+
+/// RetiredObject - Something unlinked at `epoch`, waiting to be deleted.
+struct RetiredObject
+{
+    uint64_t epoch;
+    const void *object;
+    void (*destroy)(const void *);
+};
+static std::vector<RetiredObject> RetiredObjects;
+
+/// CurrentParticipant - The calling thread's announcement, registered on first
+/// use and unregistered when the thread exits.
+EpochParticipant& CurrentParticipant()
+{
+    struct Registration
+    {
+        EpochParticipant participant;
+        Registration()
+        {
+            std::lock_guard<std::mutex> lock(EpochMutex);
+            EpochParticipants.push_back(&participant);
+        }
+        ~Registration()
+        {
+            std::lock_guard<std::mutex> lock(EpochMutex);
+            EpochParticipants.erase(std::find(EpochParticipants.begin(), EpochParticipants.end(), &participant));
+        }
+    };
+    static thread_local Registration registration;
+    return registration.participant;
+}
+
+/// EpochGuard - Keeps everything the calling thread can reach from being
+/// deleted while it is alive. Cheap to nest.
+class EpochGuard {
+  private:
+    EpochParticipant& self;
+
+  public:
+    EpochGuard()
+    : self(CurrentParticipant())
+    {
+        if (self.depth++ == 0)
+        {
+            self.epoch.store(GlobalEpoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // Order the announcement before any load of a shared pointer, and
+            // pair with the fence in ReclaimRetired.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    ~EpochGuard()
+    {
+        if (--self.depth == 0)
+            self.epoch.store(0, std::memory_order_release);
+    }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+/// ReclaimRetired - Delete the retired objects no reader can still hold.
+void ReclaimRetired()
+{
+    std::vector<RetiredObject> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(EpochMutex);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (const EpochParticipant *participant : EpochParticipants)
+        {
+            uint64_t epoch = participant->epoch.load(std::memory_order_acquire);
+            if (epoch != 0)
+                oldest = std::min(oldest, epoch);
+        }
+        auto stillHeld = std::partition(RetiredObjects.begin(), RetiredObjects.end(),
+                                        [oldest](const RetiredObject& retired) { return retired.epoch >= oldest; });
+        reclaimable.assign(stillHeld, RetiredObjects.end());
+        RetiredObjects.erase(stillHeld, RetiredObjects.end());
+    }
+    // Outside the lock: a destructor may retire objects of its own.
+    for (const RetiredObject& retired : reclaimable)
+        retired.destroy(retired.object);
+}
+
+/// Retire - Delete `object` once no reader can hold it any more. It must
+/// already be unreachable for readers that enter a guard from now on.
+template <typename T>
+void Retire(const T *object)
+{
+    if (!object)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(EpochMutex);
+        uint64_t epoch = GlobalEpoch.fetch_add(1, std::memory_order_acq_rel);
+        RetiredObjects.push_back({epoch, object, [](const void *p) { delete static_cast<const T *>(p); }});
+    }
+    ReclaimRetired();
+}
+
+#endif
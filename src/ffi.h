@@ -0,0 +1,158 @@
+// Calling native code from extern declarations
+
+#ifndef FFI_H
+#define FFI_H
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+
+// An extern names a C function taking and returning doubles. When it is
+// declared, the symbol is looked up in the libraries given with --load, then
+// in the process itself, then in libm, and calls go straight to the address
+// found. A few libm functions are known by name instead: the evaluators call
+// them as intrinsics, without going through a pointer, and the analyses treat
+// them as pure, so calls to them can be merged, memoized and forked.
+
+/// MathIntrinsic - libm functions the evaluators implement directly.
+enum MathIntrinsic
+{
+    intrinsic_none,
+    intrinsic_sin,
+    intrinsic_cos,
+    intrinsic_tan,
+    intrinsic_exp,
+    intrinsic_log,
+    intrinsic_sqrt,
+    intrinsic_fabs,
+    intrinsic_floor,
+    intrinsic_ceil,
+    intrinsic_pow,
+};
+
+/// MaxExternArity - Most arguments an extern resolved with dlsym can take.
+static const size_t MaxExternArity = 8;
+
+/// ExternLibraries - Handles of the libraries loaded with --load, searched
+/// first, in load order.
+static std::vector<void *> ExternLibraries;
+
+/// FindIntrinsic - The intrinsic called `name` taking `arity` arguments, or
+/// intrinsic_none.
+MathIntrinsic FindIntrinsic(const std::string& name, size_t arity)
+{
+    static const struct
+    {
+        const char *name;
+        size_t arity;
+        MathIntrinsic intrinsic;
+    } intrinsics[] = {
+        {"sin", 1, intrinsic_sin},   {"cos", 1, intrinsic_cos},     {"tan", 1, intrinsic_tan},
+        {"exp", 1, intrinsic_exp},   {"log", 1, intrinsic_log},     {"sqrt", 1, intrinsic_sqrt},
+        {"fabs", 1, intrinsic_fabs}, {"floor", 1, intrinsic_floor}, {"ceil", 1, intrinsic_ceil},
+        {"pow", 2, intrinsic_pow},
+    };
+    for (const auto& entry : intrinsics)
+        if (name == entry.name && arity == entry.arity)
+            return entry.intrinsic;
+    return intrinsic_none;
+}
+
+/// EvaluateIntrinsic - Apply `intrinsic` to `args`.
+double EvaluateIntrinsic(MathIntrinsic intrinsic, const double *args)
+{
+    switch (intrinsic)
+    {
+    case intrinsic_sin:
+        return std::sin(args[0]);
+    case intrinsic_cos:
+        return std::cos(args[0]);
+    case intrinsic_tan:
+        return std::tan(args[0]);
+    case intrinsic_exp:
+        return std::exp(args[0]);
+    case intrinsic_log:
+        return std::log(args[0]);
+    case intrinsic_sqrt:
+        return std::sqrt(args[0]);
+    case intrinsic_fabs:
+        return std::fabs(args[0]);
+    case intrinsic_floor:
+        return std::floor(args[0]);
+    case intrinsic_ceil:
+        return std::ceil(args[0]);
+    case intrinsic_pow:
+        return std::pow(args[0], args[1]);
+    case intrinsic_none:
+        break;
+    }
+    return 0.0;
+}
+
+/// LoadExternLibrary - Make the symbols of the shared library at `path`
+/// available to extern declarations. It is loaded with RTLD_GLOBAL so that
+/// modules built by the C backend link against it as well.
+bool LoadExternLibrary(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+    if (!handle)
+    {
+        fprintf(stderr, "Error: %s\n", dlerror());
+        return false;
+    }
+    ExternLibraries.push_back(handle);
+    return true;
+}
+
+/// ResolveExternSymbol - Address of the function `name`, or nullptr.
+void *ResolveExternSymbol(const std::string& name)
+{
+    for (void *library : ExternLibraries)
+        if (void *address = dlsym(library, name.c_str()))
+            return address;
+    if (void *address = dlsym(RTLD_DEFAULT, name.c_str()))
+        return address;
+    static void *libm = dlopen("libm.so.6", RTLD_NOW | RTLD_GLOBAL);
+    return libm ? dlsym(libm, name.c_str()) : nullptr;
+}
+
+/// CallExternAddress - Call the C function at `address` with `arity` doubles.
+double CallExternAddress(void *address, size_t arity, const double *a)
+{
+    typedef double (*F0)();
+    typedef double (*F1)(double);
+    typedef double (*F2)(double, double);
+    typedef double (*F3)(double, double, double);
+    typedef double (*F4)(double, double, double, double);
+    typedef double (*F5)(double, double, double, double, double);
+    typedef double (*F6)(double, double, double, double, double, double);
+    typedef double (*F7)(double, double, double, double, double, double, double);
+    typedef double (*F8)(double, double, double, double, double, double, double, double);
+    switch (arity)
+    {
+    case 0:
+        return reinterpret_cast<F0>(address)();
+    case 1:
+        return reinterpret_cast<F1>(address)(a[0]);
+    case 2:
+        return reinterpret_cast<F2>(address)(a[0], a[1]);
+    case 3:
+        return reinterpret_cast<F3>(address)(a[0], a[1], a[2]);
+    case 4:
+        return reinterpret_cast<F4>(address)(a[0], a[1], a[2], a[3]);
+    case 5:
+        return reinterpret_cast<F5>(address)(a[0], a[1], a[2], a[3], a[4]);
+    case 6:
+        return reinterpret_cast<F6>(address)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    case 7:
+        return reinterpret_cast<F7>(address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    case 8:
+        return reinterpret_cast<F8>(address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+    return 0.0;
+}
+
+#endif
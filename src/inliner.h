@@ -0,0 +1,285 @@
+// Function inlining
+
+#ifndef INLINER_H
+#define INLINER_H
+
+#include <cstdio>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "callgraph.h"
+#include "interpreter.h"
+
+/// InlineThreshold - Largest callee body, in AST nodes, that gets inlined.
+/// Zero disables inlining.
+static unsigned InlineThreshold = 20;
+/// InlineReport - Print every inlining decision to stderr.
+static bool InlineReport = false;
+
+/// CountNodes - Size of an expression tree.
+unsigned CountNodes(const ExprAST& expr)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        return 1;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        return 1 + CountNodes(bin.getLHS()) + CountNodes(bin.getRHS());
+    }
+    case expr_call:
+    {
+        unsigned count = 1;
+        for (const auto& arg : static_cast<const CallExprAST&>(expr).getArgs())
+            count += CountNodes(*arg);
+        return count;
+    }
+    }
+    return 1;
+}
+
+/// CloneExpr - Deep copy of an expression, without resolution state.
+std::unique_ptr<ExprAST> CloneExpr(const ExprAST& expr)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return std::make_unique<NumberExprAST>(static_cast<const NumberExprAST&>(expr).getValue());
+    case expr_variable:
+        return std::make_unique<VariableExprAST>(static_cast<const VariableExprAST&>(expr).getName());
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        return std::make_unique<BinaryExprAST>(bin.getOp(), CloneExpr(bin.getLHS()), CloneExpr(bin.getRHS()));
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        std::vector<std::unique_ptr<ExprAST> > args;
+        for (const auto& arg : call.getArgs())
+            args.push_back(CloneExpr(*arg));
+        return std::make_unique<CallExprAST>(call.getCallee(), std::move(args));
+    }
+    }
+    return nullptr;
+}
+
+/// CountUses - How often each parameter of a resolved body is read.
+void CountUses(const ExprAST& expr, std::vector<unsigned>& uses)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return;
+    case expr_variable:
+        ++uses[static_cast<const VariableExprAST&>(expr).getIndex()];
+        return;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        CountUses(bin.getLHS(), uses);
+        CountUses(bin.getRHS(), uses);
+        return;
+    }
+    case expr_call:
+        for (const auto& arg : static_cast<const CallExprAST&>(expr).getArgs())
+            CountUses(*arg, uses);
+        return;
+    }
+}
+
+/// CallsBeforeUse - Whether evaluating `expr` makes a call before it first
+/// reads parameter `index`. Sets `decided` once either has happened.
+bool CallsBeforeUse(const ExprAST& expr, unsigned index, bool& decided)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return false;
+    case expr_variable:
+        decided = static_cast<const VariableExprAST&>(expr).getIndex() == index;
+        return false;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        bool calls = CallsBeforeUse(bin.getLHS(), index, decided);
+        return decided ? calls : CallsBeforeUse(bin.getRHS(), index, decided);
+    }
+    case expr_call:
+        for (const auto& arg : static_cast<const CallExprAST&>(expr).getArgs())
+        {
+            bool calls = CallsBeforeUse(*arg, index, decided);
+            if (decided)
+                return calls;
+        }
+        decided = true; // the call itself, after its arguments
+        return true;
+    }
+    return false;
+}
+
+/// SubstituteArgs - Copy a resolved callee body, replacing each parameter
+/// reference with the matching argument. An argument read exactly once is
+/// moved into place; others are cloned.
+std::unique_ptr<ExprAST> SubstituteArgs(const ExprAST& body, std::vector<std::unique_ptr<ExprAST> >& args,
+                                        const std::vector<unsigned>& uses)
+{
+    switch (body.getKind())
+    {
+    case expr_number:
+        return CloneExpr(body);
+    case expr_variable:
+    {
+        unsigned index = static_cast<const VariableExprAST&>(body).getIndex();
+        if (uses[index] == 1)
+            return std::move(args[index]);
+        return CloneExpr(*args[index]);
+    }
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(body);
+        auto LHS = SubstituteArgs(bin.getLHS(), args, uses);
+        auto RHS = SubstituteArgs(bin.getRHS(), args, uses);
+        return std::make_unique<BinaryExprAST>(bin.getOp(), std::move(LHS), std::move(RHS));
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(body);
+        std::vector<std::unique_ptr<ExprAST> > callArgs;
+        for (const auto& arg : call.getArgs())
+            callArgs.push_back(SubstituteArgs(*arg, args, uses));
+        return std::make_unique<CallExprAST>(call.getCallee(), std::move(callArgs));
+    }
+    }
+    return nullptr;
+}
+
+/// IsRecursive - Whether the function in `slot` can reach itself through calls.
+bool IsRecursive(unsigned slot)
+{
+    std::set<unsigned> visited;
+    std::vector<unsigned> worklist = {slot};
+    while (!worklist.empty())
+    {
+        unsigned f = worklist.back();
+        worklist.pop_back();
+        if (!FunctionSlots[f]->definition)
+            continue;
+        std::vector<unsigned> callees;
+        CollectCallees(FunctionSlots[f]->definition->getBody(), callees);
+        for (unsigned callee : callees)
+        {
+            if (callee == slot)
+                return true;
+            if (visited.insert(callee).second)
+                worklist.push_back(callee);
+        }
+    }
+    return false;
+}
+
+/// InlineVeto - Why `call` must not be inlined into `caller`, or nullptr if
+/// it may be. `uses` receives the callee's parameter use counts.
+const char *InlineVeto(const std::string& caller, const CallExprAST& call, std::vector<unsigned>& uses)
+{
+    if (call.getCallee() == caller)
+        return "recursive";
+    const FunctionSlot *slot = ReferenceFunction(call.getCallee());
+    if (!slot || !slot->definition || slot->arity != call.getArgs().size())
+        return "not a known definition";
+    const ExprAST& body = slot->definition->getBody();
+    if (CountNodes(body) > InlineThreshold)
+        return "too large";
+    if (IsRecursive(slot->index))
+        return "recursive";
+
+    uses.assign(slot->arity, 0);
+    CountUses(body, uses);
+    unsigned argsWithCalls = 0;
+    for (size_t i = 0; i < uses.size(); ++i)
+    {
+        const ExprAST& arg = *call.getArgs()[i];
+        bool trivial = arg.getKind() == expr_number || arg.getKind() == expr_variable;
+        if (uses[i] > 1 && !trivial)
+            return "would evaluate an argument more than once";
+        if (ContainsCall(arg))
+        {
+            // Dropping or reordering calls could reorder calls into externs.
+            if (uses[i] == 0)
+                return "would drop an argument with calls";
+            bool decided = false;
+            if (CallsBeforeUse(body, i, decided))
+                return "would make a call before an argument with calls";
+            ++argsWithCalls;
+        }
+    }
+    if (argsWithCalls > 1)
+        return "would reorder arguments with calls";
+    return nullptr;
+}
+
+/// InlineCallsIn - Inline eligible calls in `expr`, innermost first, adding
+/// the slot of each callee inlined to `inlined`.
+unsigned InlineCallsIn(std::unique_ptr<ExprAST>& expr, const std::string& caller, std::vector<unsigned>& inlined)
+{
+    unsigned count = 0;
+    switch (expr->getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        return 0;
+    case expr_binary:
+    {
+        auto& bin = static_cast<BinaryExprAST&>(*expr);
+        count += InlineCallsIn(bin.getLHSPtr(), caller, inlined);
+        count += InlineCallsIn(bin.getRHSPtr(), caller, inlined);
+        return count;
+    }
+    case expr_call:
+        break;
+    }
+
+    auto& call = static_cast<CallExprAST&>(*expr);
+    for (auto& arg : call.getArgs())
+        count += InlineCallsIn(arg, caller, inlined);
+
+    std::vector<unsigned> uses;
+    const char *veto = InlineVeto(caller, call, uses);
+    if (InlineReport)
+    {
+        const char *into = caller.empty() ? "<top-level>" : caller.c_str();
+        if (veto)
+            fprintf(stderr, "inline: kept call to %s in %s: %s\n", call.getCallee().c_str(), into, veto);
+        else
+            fprintf(stderr, "inline: inlined %s into %s\n", call.getCallee().c_str(), into);
+    }
+    if (veto)
+        return count;
+
+    // Callees are inlined into when they are defined, so the body substituted
+    // here is already flat and inlining does not need to iterate.
+    const FunctionSlot& slot = *FindFunction(call.getCallee());
+    inlined.push_back(slot.index);
+    expr = SubstituteArgs(slot.definition->getBody(), call.getArgs(), uses);
+    return count + 1;
+}
+
+/// InlineCalls - Inline small non-recursive callees into `function`. With
+/// `inlined`, also report which slots were copied in.
+unsigned InlineCalls(FunctionAST& function, std::vector<unsigned> *inlined = nullptr)
+{
+    if (InlineThreshold == 0)
+        return 0;
+    std::vector<unsigned> callees;
+    unsigned count = InlineCallsIn(function.getBodyPtr(), function.getPrototype().getName(), callees);
+    if (inlined)
+        *inlined = std::move(callees);
+    return count;
+}
+
+#endif
@@ -0,0 +1,1101 @@
+// Tree-walking interpreter
+
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ast.h"
+#include "callgraph.h"
+#include "epoch.h"
+#include "ffi.h"
+#include "ir.h"
+#include "lexer.h"
+#include "memo.h"
+#include "regalloc.h"
+#include "threadpool.h"
+
+/// NativeEntry - Uniform entry point into compiled code: takes the arguments
+/// as an array, whatever the arity.
+typedef double (*NativeEntry)(const double *args);
+struct NativeModule; // see codememory.h
+
+/// FunctionVersion - What a call into a slot runs: one definition with the
+/// code built for it and the analysis results that affect calls. A version
+/// never changes once published. Redefining, compiling or reanalysing a
+/// function publishes a new version with an atomic swap; calls that already
+/// loaded the old one finish in it, and it is retired to epoch.h.
+struct FunctionVersion
+{
+    bool isExtern = false;
+    MathIntrinsic intrinsic = intrinsic_none;
+    void *externAddress = nullptr;
+    std::shared_ptr<const FunctionAST> definition;
+    bool ready = false; // Code is built; otherwise calls go to CompileFunction.
+    std::shared_ptr<const IRFunction> ir;
+    NativeEntry native = nullptr;
+    std::shared_ptr<NativeModule> nativeModule; // Holds `native`.
+    bool memoize = false;
+    std::shared_ptr<ConcurrentMemoTable> sharedMemo;
+    unsigned memoGeneration = 0; // See MemoGeneration.
+};
+
+struct Session;
+
+/// FunctionSlot - One entry in the function table. Call sites are resolved to
+/// a slot index once, so redefining a function only has to swap the slot's
+/// definition.
+///
+/// The fields below `version` belong to the writers of the table, who hold
+/// TableMutex while they read or change them and publish a new version after a
+/// change. The call path reads nothing but `version`.
+struct FunctionSlot
+{
+    std::string name;
+    size_t arity;
+    unsigned index;   // Position in FunctionSlots.
+    Session *session; // Owner of a private slot; null in the shared table.
+    std::atomic<const FunctionVersion *> version{nullptr};
+
+    bool isExtern;                           // Declared with 'extern' and never defined.
+    std::shared_ptr<FunctionAST> definition; // Null while isExtern or deferred.
+    // What an extern calls: a known libm function, or else the address that
+    // dlsym found for it. An extern with neither cannot be called.
+    MathIntrinsic intrinsic = intrinsic_none;
+    void *externAddress = nullptr;
+
+    // A def whose body has not been parsed yet: its parameter names and the
+    // recorded tokens of the body, parsed by MaterializeFunction on the first
+    // reference to the function.
+    bool deferred = false;
+    std::vector<std::string> deferredArgs;
+    std::vector<TokenRecord> deferredBody;
+
+    // Reverse dependency index, kept by DefineFunction: the defs whose body
+    // calls this slot, and those that hold an inlined copy of it. A def that
+    // inlined anything also keeps its body as parsed, before inlining, so that
+    // it can be rebuilt when one of the callees it copied is redefined.
+    std::set<unsigned> callers;
+    std::set<unsigned> inlinedInto;
+    std::vector<unsigned> inlined;
+    std::unique_ptr<ExprAST> source;
+
+    // Filled in by PrepareForEvaluation.
+    bool pure = false;
+    double cost = 0;
+    bool memoize = false;
+    std::shared_ptr<ConcurrentMemoTable> sharedMemo;
+    unsigned memoGeneration = 0;
+    // Code for the current definition, built by CompileFunction on the first
+    // call after `ready` was cleared.
+    bool ready = false;
+    std::shared_ptr<IRFunction> ir; // Optimized IR, unless Backend is backend_ast.
+    NativeEntry native = nullptr;    // Compiled code, when Backend is backend_c.
+    std::shared_ptr<NativeModule> nativeModule; // The module `native` is in.
+
+    // A slot is only destroyed when no call can reach it.
+    ~FunctionSlot() { delete version.load(std::memory_order_relaxed); }
+};
+
+/// FunctionSlots - Every function or extern seen so far, in declaration order.
+static std::vector<std::unique_ptr<FunctionSlot> > FunctionSlots;
+/// FunctionIndex - Maps a function name to its position in FunctionSlots.
+static std::map<std::string, unsigned> FunctionIndex;
+/// FreeSlots - Positions in FunctionSlots left by RemoveSlot, for AddSlot to
+/// reuse. Each holds a placeholder with no definition until then.
+static std::vector<unsigned> FreeSlots;
+
+// Sessions
+// ======================================================================================
+//
+// A host serving many clients loads a common library of defs once, before any
+// client connects, and compiles it (SealSharedImage). That shared table is
+// never changed afterwards. Each client works in a Session: its defs and
+// externs get private slots, visible to that session only, and a def of a
+// name the library has shadows the library's slot instead of replacing it, so
+// library functions keep calling each other. A session therefore costs its own
+// slots and one map, however large the library is.
+
+/// Session - A client's private overlay on the shared function table.
+struct Session
+{
+    std::map<std::string, unsigned> functions; // Private slots by name.
+};
+
+/// CurrentSession - The session the calling thread defines and looks up names
+/// in, or null to work on the shared table.
+static thread_local Session *CurrentSession = nullptr;
+
+// ======================================================================================
+
+/// CallTable - FunctionSlots as the call path sees it. Calls index a fixed
+/// array rather than the vector, which may reallocate under them: a new slot
+/// goes into spare capacity, and only when there is none is a copy twice the
+/// size published and the old array retired.
+struct CallTable
+{
+    std::vector<FunctionSlot *> slots; // Sized to the capacity up front.
+};
+static std::atomic<CallTable *> PublishedCalls{nullptr};
+
+/// TableMutex - Held by everything that reads or changes the writer side of
+/// the function table: definitions, analyses and compilation, including
+/// CompileFunction when an evaluating thread reaches code that is not built
+/// yet. Never held while evaluating, so a call takes no lock once the code it
+/// runs exists. Recursive, because defining a function can materialize or
+/// rebuild others.
+static std::recursive_mutex TableMutex;
+
+/// ExecutionBackend - How function bodies run: by walking the resolved AST, by
+/// interpreting the optimized IR lowered from it, or as native code.
+enum ExecutionBackend
+{
+    backend_ast,
+    backend_ir,
+    backend_c, // defs compiled by the system C compiler, see cbackend.h
+};
+static ExecutionBackend Backend = backend_ast;
+/// DumpIR - Print each function's optimized IR when it is lowered.
+static bool DumpIR = false;
+/// EagerCompilation - Build code for every function before evaluating,
+/// instead of for each function on its first call.
+static bool EagerCompilation = false;
+/// CompileBatchSize - With a nonzero size, defs are not built one call root
+/// at a time: code for the defs installed since the last batch is built as one
+/// module once this many have accumulated, or before a top-level expression
+/// runs. That pays the fixed cost of a module (a compiler process, loading
+/// the result) once per batch rather than once per function.
+static size_t CompileBatchSize = 0;
+/// BatchedDefinitions - Defs installed since the last batch was built.
+static size_t BatchedDefinitions = 0;
+/// BackgroundCompilation - Defs are installed and their code built by the
+/// compile thread of compilequeue.h. A call into a function whose code is not
+/// built yet runs its body on the AST interpreter rather than waiting for it.
+static bool BackgroundCompilation = false;
+/// CompileThreads - Threads that lower or build a large set of functions at
+/// once. Compilation gets its own short-lived pool, so that it can run while
+/// threads of the evaluation pool are blocked waiting for it.
+static unsigned CompileThreads = std::thread::hardware_concurrency();
+/// ParallelLowerMin - Fewest functions CompileAll lowers on several threads.
+static const size_t ParallelLowerMin = 64;
+/// ReportMutex - Keeps the IR and register allocation listings of functions
+/// lowered concurrently from interleaving.
+static std::mutex ReportMutex;
+
+/// MemoizationMode, MemoCapacity - Whether and how pure functions cache
+/// their results, and how many entries each function's table holds.
+static MemoMode MemoizationMode = memo_off;
+static size_t MemoCapacity = 4096;
+
+/// DirtySlots - Shared slots that changed since the last PrepareForEvaluation,
+/// which reanalyses them and everything that calls them.
+static std::set<unsigned> DirtySlots;
+/// DirtySessions - Sessions whose private slots changed since the last
+/// PrepareForEvaluation, which reanalyses just those slots.
+static std::set<Session *> DirtySessions;
+/// MemoGeneration - Bumped by every analysis and stamped on the versions of
+/// the slots it covered, whose memoized results may have gone stale. A
+/// per-thread table built for an older stamp is discarded on next use.
+static std::atomic<unsigned> MemoGeneration{0};
+
+/// EvaluationPool - Pool that forked operands run on; null evaluates everything
+/// on the calling thread.
+static ThreadPool *EvaluationPool = nullptr;
+/// ForkGrainSize - Estimated cost both operands of a binary expression must
+/// reach before they are evaluated in parallel. Below it, the cost of spawning
+/// a task outweighs the work it saves.
+static double ForkGrainSize = 10000;
+
+/// LogErrorR - Error helper for the resolution step.
+bool LogErrorR(const std::string& str)
+{
+    fprintf(stderr, "Error: %s\n", str.c_str());
+    return false;
+}
+
+/// MarkAnalysisDirty - Note that `slot` changed, for PrepareForEvaluation.
+void MarkAnalysisDirty(const FunctionSlot& slot)
+{
+    if (slot.session)
+        DirtySessions.insert(slot.session);
+    else
+        DirtySlots.insert(slot.index);
+}
+
+/// PublishVersion - Make the current definition and code of `slot` what new
+/// calls into it run.
+void PublishVersion(FunctionSlot& slot)
+{
+    auto version = new FunctionVersion;
+    version->isExtern = slot.isExtern;
+    version->intrinsic = slot.intrinsic;
+    version->externAddress = slot.externAddress;
+    version->definition = slot.definition;
+    version->ready = slot.ready;
+    version->ir = slot.ir;
+    // A module is unloaded once the last version using it is retired.
+    if (!slot.native)
+        slot.nativeModule.reset();
+    version->native = slot.native;
+    version->nativeModule = slot.nativeModule;
+    version->memoize = slot.memoize;
+    version->sharedMemo = slot.sharedMemo;
+    version->memoGeneration = slot.memoGeneration;
+    Retire(slot.version.exchange(version, std::memory_order_acq_rel));
+}
+
+/// NewPlaceholder - An empty slot to fill position `index` while it is unused.
+std::unique_ptr<FunctionSlot> NewPlaceholder(unsigned index)
+{
+    auto slot = std::make_unique<FunctionSlot>();
+    slot->arity = 0;
+    slot->index = index;
+    slot->session = nullptr;
+    slot->isExtern = true;
+    PublishVersion(*slot);
+    return slot;
+}
+
+/// CallSlot - The slot a resolved call refers to, for the call path.
+const FunctionSlot& CallSlot(unsigned index)
+{
+    return *PublishedCalls.load(std::memory_order_acquire)->slots[index];
+}
+
+/// AddSlot - Append a new slot for `name` to the function table.
+FunctionSlot *AddSlot(const std::string& name, size_t arity, bool isExtern)
+{
+    auto slot = std::make_unique<FunctionSlot>();
+    slot->name = name;
+    slot->arity = arity;
+    slot->index = FunctionSlots.size();
+    if (!FreeSlots.empty())
+    {
+        slot->index = FreeSlots.back();
+        FreeSlots.pop_back();
+    }
+    slot->session = CurrentSession;
+    slot->isExtern = isExtern;
+    PublishVersion(*slot);
+    if (CurrentSession)
+        CurrentSession->functions[name] = slot->index;
+    else
+        FunctionIndex[name] = slot->index;
+
+    CallTable *calls = PublishedCalls.load(std::memory_order_relaxed);
+    if (!calls || calls->slots.size() <= slot->index)
+    {
+        auto grown = new CallTable;
+        grown->slots.resize(std::max<size_t>(64, 2 * FunctionSlots.size()));
+        for (size_t i = 0; i < FunctionSlots.size(); ++i)
+            grown->slots[i] = FunctionSlots[i].get();
+        PublishedCalls.store(grown, std::memory_order_release);
+        Retire(calls);
+        calls = grown;
+    }
+    calls->slots[slot->index] = slot.get();
+
+    unsigned index = slot->index;
+    if (index == FunctionSlots.size())
+        FunctionSlots.push_back(std::move(slot));
+    else
+    {
+        Retire(FunctionSlots[index].release());
+        FunctionSlots[index] = std::move(slot);
+    }
+    MarkAnalysisDirty(*FunctionSlots[index]);
+    return FunctionSlots[index].get();
+}
+
+/// FindFunction - Return the slot for `name`, or nullptr if it was never
+/// declared. The current session's own slots come first.
+FunctionSlot *FindFunction(const std::string& name)
+{
+    if (CurrentSession)
+    {
+        auto it = CurrentSession->functions.find(name);
+        if (it != CurrentSession->functions.end())
+            return FunctionSlots[it->second].get();
+    }
+    auto it = FunctionIndex.find(name);
+    return it == FunctionIndex.end() ? nullptr : FunctionSlots[it->second].get();
+}
+
+/// SymbolName - A name for `slot` that no other slot has: its own, except for
+/// a session's def that shadows a shared one, which gets its index appended.
+/// Source identifiers cannot contain '_', so the result is never taken.
+std::string SymbolName(const FunctionSlot& slot)
+{
+    if (slot.session && FunctionIndex.count(slot.name))
+        return slot.name + "_" + std::to_string(slot.index);
+    return slot.name;
+}
+
+bool MaterializeFunction(FunctionSlot& slot);
+
+/// ReferenceFunction - FindFunction for a use of `name` in code: a deferred
+/// body is parsed first. Returns nullptr if it fails to materialize.
+FunctionSlot *ReferenceFunction(const std::string& name)
+{
+    FunctionSlot *slot = FindFunction(name);
+    if (slot && slot->deferred && !MaterializeFunction(*slot))
+        return nullptr;
+    return slot;
+}
+
+/// MaterializeAll - Parse every deferred body, for whole-program consumers.
+void MaterializeAll()
+{
+    for (size_t i = 0; i < FunctionSlots.size(); ++i)
+        if (FunctionSlots[i]->deferred)
+            MaterializeFunction(*FunctionSlots[i]);
+}
+
+/// ResolveExpr - Bind variable references to argument positions and call
+/// sites to function slots, checking everything the evaluator relies on.
+bool ResolveExpr(ExprAST& expr, const PrototypeAST& prototype)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return true;
+    case expr_variable:
+    {
+        auto& var = static_cast<VariableExprAST&>(expr);
+        const std::vector<std::string>& params = prototype.getArgs();
+        for (unsigned i = 0; i < params.size(); ++i)
+        {
+            if (params[i] == var.getName())
+            {
+                var.setIndex(i);
+                return true;
+            }
+        }
+        return LogErrorR("Unknown variable name '" + var.getName() + "'");
+    }
+    case expr_binary:
+    {
+        auto& bin = static_cast<BinaryExprAST&>(expr);
+        switch (bin.getOp())
+        {
+        case '+':
+        case '-':
+        case '*':
+        case '<':
+            break;
+        default:
+            return LogErrorR(std::string("Invalid binary operator '") + bin.getOp() + "'");
+        }
+        return ResolveExpr(bin.getLHS(), prototype) && ResolveExpr(bin.getRHS(), prototype);
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<CallExprAST&>(expr);
+        const FunctionSlot *found = ReferenceFunction(call.getCallee());
+        if (!found)
+            return LogErrorR("Unknown function referenced '" + call.getCallee() + "'");
+        const FunctionSlot& slot = *found;
+        if (slot.arity != call.getArgs().size())
+            return LogErrorR("Incorrect # arguments passed to '" + call.getCallee() + "'");
+        if (slot.isExtern && !slot.intrinsic && !slot.externAddress)
+            return LogErrorR("Extern '" + call.getCallee() + "' has no implementation");
+        call.setSlot(slot.index);
+        for (auto& arg : call.getArgs())
+            if (!ResolveExpr(*arg, prototype))
+                return false;
+        return true;
+    }
+    }
+    return false;
+}
+
+/// DeclareExtern - Record an extern prototype and find what it calls, see
+/// ffi.h. An extern for a name that is already defined is accepted as long as
+/// the arity agrees.
+bool DeclareExtern(const PrototypeAST& prototype)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (FunctionSlot *slot = FindFunction(prototype.getName()))
+    {
+        if (slot->arity != prototype.getArgs().size())
+            return LogErrorR("Redefinition of function '" + prototype.getName() + "' with different # args");
+        return true;
+    }
+    FunctionSlot *slot = AddSlot(prototype.getName(), prototype.getArgs().size(), true);
+    slot->intrinsic = FindIntrinsic(slot->name, slot->arity);
+    if (!slot->intrinsic && slot->arity <= MaxExternArity)
+        slot->externAddress = ResolveExternSymbol(slot->name);
+    PublishVersion(*slot);
+    return true;
+}
+
+/// DeferFunction - Record a def whose body is left unparsed until the function
+/// is referenced. Only names that have no parsed body yet may be deferred,
+/// since no call site can be bound to them.
+bool DeferFunction(const std::string& name, std::vector<std::string> args, std::vector<TokenRecord> body)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    FunctionSlot *slot = FindFunction(name);
+    if (slot && slot->arity != args.size())
+        return LogErrorR("Redefinition of function '" + name + "' with different # args");
+    if (!slot)
+        slot = AddSlot(name, args.size(), false);
+    slot->deferred = true;
+    slot->deferredArgs = std::move(args);
+    slot->deferredBody = std::move(body);
+    return true;
+}
+
+/// UnlinkDependencies - Remove the current definition of `slot` from the
+/// reverse dependency index.
+void UnlinkDependencies(FunctionSlot& slot)
+{
+    if (slot.definition)
+    {
+        std::vector<unsigned> callees;
+        CollectCallees(slot.definition->getBody(), callees);
+        for (unsigned callee : callees)
+            FunctionSlots[callee]->callers.erase(slot.index);
+    }
+    for (unsigned callee : slot.inlined)
+        FunctionSlots[callee]->inlinedInto.erase(slot.index);
+    slot.inlined.clear();
+    slot.source.reset();
+}
+
+/// RemoveSlot - Take a slot that nothing can call any more out of the table,
+/// leaving a placeholder in its position for AddSlot to reuse.
+void RemoveSlot(unsigned index)
+{
+    FunctionSlot& slot = *FunctionSlots[index];
+    UnlinkDependencies(slot);
+    if (slot.session)
+        slot.session->functions.erase(slot.name);
+    else
+        FunctionIndex.erase(slot.name);
+    MarkAnalysisDirty(slot);
+
+    std::unique_ptr<FunctionSlot> placeholder = NewPlaceholder(index);
+    PublishedCalls.load(std::memory_order_relaxed)->slots[index] = placeholder.get();
+    Retire(FunctionSlots[index].release());
+    FunctionSlots[index] = std::move(placeholder);
+    FreeSlots.push_back(index);
+}
+
+/// ReleaseSession - Remove every slot `session` owns, once none of its code
+/// is running any more.
+void ReleaseSession(Session& session)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    while (!session.functions.empty())
+        RemoveSlot(session.functions.begin()->second);
+    DirtySessions.erase(&session);
+}
+
+/// DiscardNativeCallers - Drop the native code of everything that can reach
+/// `index` through calls. A native module has its own copy of every def it
+/// calls, so each of those modules still runs the old body.
+void DiscardNativeCallers(unsigned index)
+{
+    std::set<unsigned> visited;
+    std::vector<unsigned> worklist(FunctionSlots[index]->callers.begin(), FunctionSlots[index]->callers.end());
+    while (!worklist.empty())
+    {
+        unsigned caller = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(caller).second)
+            continue;
+        FunctionSlot& slot = *FunctionSlots[caller];
+        if (slot.native)
+        {
+            slot.native = nullptr;
+            slot.ready = false;
+            PublishVersion(slot);
+        }
+        worklist.insert(worklist.end(), slot.callers.begin(), slot.callers.end());
+    }
+}
+
+/// DefineFunction - Resolve `function` and install it in the function table,
+/// replacing any previous definition with the same name and arity. `inlined`
+/// lists the slots whose bodies were inlined into it, and `source` is its body
+/// before that, for RebuildInliners.
+bool DefineFunction(std::unique_ptr<FunctionAST> function, std::unique_ptr<ExprAST> source = nullptr,
+                    std::vector<unsigned> inlined = {})
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    const PrototypeAST& prototype = function->getPrototype();
+    FunctionSlot *slot = FindFunction(prototype.getName());
+    if (slot && CurrentSession && !slot->session)
+        slot = nullptr; // shadow the shared def, see Session
+    bool isNew = !slot;
+    if (slot && slot->arity != prototype.getArgs().size())
+        return LogErrorR("Redefinition of function '" + prototype.getName() + "' with different # args");
+
+    if (isNew)
+    {
+        // Register the slot up front so the body may call itself.
+        slot = AddSlot(prototype.getName(), prototype.getArgs().size(), false);
+    }
+
+    bool wasExtern = slot->isExtern;
+    slot->isExtern = false;
+    if (!ResolveExpr(function->getBody(), prototype))
+    {
+        slot->isExtern = wasExtern;
+        if (isNew)
+            RemoveSlot(slot->index);
+        return false;
+    }
+
+    bool redefined = slot->definition != nullptr;
+    UnlinkDependencies(*slot);
+    slot->definition = std::move(function);
+    std::vector<unsigned> callees;
+    CollectCallees(slot->definition->getBody(), callees);
+    // Shared slots never change, so they need not know about private callers.
+    for (unsigned callee : callees)
+        if (FunctionSlots[callee]->session == slot->session)
+            FunctionSlots[callee]->callers.insert(slot->index);
+    for (unsigned callee : inlined)
+        if (FunctionSlots[callee]->session == slot->session)
+            FunctionSlots[callee]->inlinedInto.insert(slot->index);
+    slot->inlined = std::move(inlined);
+    slot->source = std::move(source);
+    if (redefined)
+        DiscardNativeCallers(slot->index);
+
+    slot->intrinsic = intrinsic_none;
+    slot->externAddress = nullptr;
+    slot->ready = false;
+    slot->ir.reset();
+    slot->native = nullptr;
+    PublishVersion(*slot);
+    MarkAnalysisDirty(*slot);
+    return true;
+}
+
+/// SlotCosts - The estimated cost of each function, by slot index.
+std::vector<double> SlotCosts()
+{
+    std::vector<double> costs;
+    for (const auto& slot : FunctionSlots)
+        costs.push_back(slot->cost);
+    return costs;
+}
+
+/// MarkForkPoints - Flag the binary expressions in `expr` whose operands are
+/// pure and both expensive enough to be worth evaluating as parallel tasks.
+/// Works bottom-up in one pass: returns the EstimateCost of `expr`, and sets
+/// `pure` to whether it only calls pure functions, so that it may run
+/// concurrently with, or in a different order from, its neighbours.
+double MarkForkPoints(ExprAST& expr, const std::vector<double>& costs, bool& pure)
+{
+    double cost = 1;
+    pure = true;
+    switch (expr.getKind())
+    {
+    case expr_number:
+    case expr_variable:
+        break;
+    case expr_binary:
+    {
+        auto& bin = static_cast<BinaryExprAST&>(expr);
+        bool lhsPure, rhsPure;
+        double lhsCost = MarkForkPoints(bin.getLHS(), costs, lhsPure);
+        double rhsCost = MarkForkPoints(bin.getRHS(), costs, rhsPure);
+        pure = lhsPure && rhsPure;
+        bin.setParallel(ForkGrainSize > 0 && lhsCost >= ForkGrainSize && rhsCost >= ForkGrainSize && pure);
+        cost += lhsCost + rhsCost;
+        break;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<CallExprAST&>(expr);
+        cost += costs[call.getSlot()];
+        pure = FunctionSlots[call.getSlot()]->pure;
+        for (auto& arg : call.getArgs())
+        {
+            bool argPure;
+            cost += MarkForkPoints(*arg, costs, argPure);
+            pure = pure && argPure;
+        }
+        break;
+    }
+    }
+    return cost < CostUnbounded ? cost : CostUnbounded;
+}
+
+void MarkForkPoints(ExprAST& expr, const std::vector<double>& costs)
+{
+    bool pure;
+    MarkForkPoints(expr, costs, pure);
+}
+
+void MarkForkPoints(ExprAST& expr)
+{
+    MarkForkPoints(expr, SlotCosts());
+}
+
+bool CompileNativeModule(const std::vector<unsigned>& roots, bool importBuilt = false);
+
+/// LowerToIR - Lower a resolved body and run the IR optimizations on it. Uses
+/// the purity computed by the last PrepareForEvaluation. Safe to call from
+/// several threads while the function table is not changing.
+IRFunction LowerToIR(const std::string& name, size_t arity, const ExprAST& body)
+{
+    std::vector<bool> pureSlots;
+    for (const auto& slot : FunctionSlots)
+        pureSlots.push_back(slot->pure);
+    IRFunction function = LowerFunction(name, arity, body);
+    OptimizeIR(function, pureSlots);
+    if (!DumpIR && !RegAllocReport)
+        return function;
+
+    std::lock_guard<std::mutex> lock(ReportMutex);
+    if (DumpIR)
+    {
+        std::vector<std::string> slotNames;
+        for (const auto& slot : FunctionSlots)
+            slotNames.push_back(slot->name);
+        PrintIR(function, slotNames, stderr);
+    }
+    if (RegAllocReport)
+    {
+        RegAllocation allocation = AllocateRegisters(function);
+        CheckAllocation(function, allocation);
+        PrintRegAllocReport(function, allocation, stderr);
+    }
+    return function;
+}
+
+/// CompileFunction - The stub behind every slot whose code is not ready.
+/// Builds the code for the slot's current definition on the configured
+/// backend; the C backend compiles the function together with everything it
+/// calls and patches all of their slots at once. Safe to call from any number
+/// of evaluating threads. Returns the version that now holds the code.
+const FunctionVersion& CompileFunction(unsigned index)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    FunctionSlot& slot = *FunctionSlots[index];
+    if (!slot.ready)
+    {
+        if (Backend == backend_c)
+            CompileNativeModule({index});
+        if (Backend != backend_ast && !slot.native && !slot.ir)
+            slot.ir = std::make_unique<IRFunction>(LowerToIR(slot.name, slot.arity, slot.definition->getBody()));
+        slot.ready = true;
+        PublishVersion(slot);
+    }
+    return *slot.version.load(std::memory_order_acquire);
+}
+
+/// CompileFunctions - Build code for the functions in `pending` together: the
+/// C backend puts them all in one module, which it splits when large, see
+/// CompileNativeModule, and a large set is lowered to IR on CompileThreads
+/// threads and installed afterwards.
+void CompileFunctions(const std::vector<unsigned>& pending)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (Backend == backend_c && !pending.empty())
+        CompileNativeModule(pending, true);
+
+    if (Backend == backend_ir && pending.size() >= ParallelLowerMin && CompileThreads > 1)
+    {
+        std::vector<std::unique_ptr<IRFunction> > lowered(pending.size());
+        ThreadPool compilePool(CompileThreads);
+        compilePool.parallelFor(pending.size(), [&](size_t i) {
+            const FunctionSlot& slot = *FunctionSlots[pending[i]];
+            lowered[i] = std::make_unique<IRFunction>(LowerToIR(slot.name, slot.arity, slot.definition->getBody()));
+        });
+        for (size_t i = 0; i < pending.size(); ++i)
+            FunctionSlots[pending[i]]->ir = std::move(lowered[i]);
+    }
+    for (unsigned index : pending)
+        CompileFunction(index);
+}
+
+/// CompileAll - Build code for every function that does not have it yet.
+void CompileAll()
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    std::vector<unsigned> pending;
+    for (const auto& slot : FunctionSlots)
+        if (slot->definition && !slot->ready)
+            pending.push_back(slot->index);
+    CompileFunctions(pending);
+}
+
+/// AnalyseSlots - Rerun the analyses for the slots in `members`, taking what
+/// was found for every other slot as final: purity and cost over the call
+/// graph, and from those which functions get a memo table and which operands
+/// are forked.
+void AnalyseSlots(const std::vector<unsigned>& members)
+{
+    size_t n = FunctionSlots.size();
+    std::vector<std::vector<unsigned> > callees(n);
+    std::vector<bool> impure(n, false);
+    std::vector<const ExprAST *> bodies(n, nullptr);
+    for (size_t i = 0; i < n; ++i)
+        impure[i] = !FunctionSlots[i]->pure;
+    for (unsigned i : members)
+    {
+        const FunctionSlot& slot = *FunctionSlots[i];
+        if (!slot.definition)
+        {
+            // Nothing is known about what an extern does, apart from the libm
+            // intrinsics. A deferred body is not called by anything yet.
+            impure[i] = !slot.intrinsic;
+        }
+        else
+        {
+            impure[i] = false;
+            CollectCallees(slot.definition->getBody(), callees[i]);
+            bodies[i] = &slot.definition->getBody();
+        }
+    }
+    std::vector<bool> pure = ComputePurity(callees, impure);
+    std::vector<double> costs = SlotCosts();
+    ComputeFunctionCosts(bodies, members, costs);
+    unsigned generation = MemoGeneration.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    // Value numbering merges calls into pure functions, so when a function
+    // that already has callers with code changes purity, those callers relower.
+    std::vector<bool> relower(n, false);
+    for (unsigned i : members)
+    {
+        FunctionSlot& slot = *FunctionSlots[i];
+        if (slot.pure != pure[i])
+        {
+            for (unsigned caller : slot.callers)
+                relower[caller] = true;
+            DiscardNativeCallers(i);
+        }
+        slot.pure = pure[i];
+        slot.cost = costs[i];
+    }
+    for (unsigned i : members)
+    {
+        FunctionSlot& slot = *FunctionSlots[i];
+        if (!slot.definition)
+            continue;
+        MarkForkPoints(slot.definition->getBody(), costs);
+        // Leaf arithmetic is cheaper to recompute than to look up, so only
+        // functions that make calls are worth memoizing.
+        slot.memoize = MemoizationMode != memo_off && pure[i] && ContainsCall(slot.definition->getBody());
+        slot.sharedMemo.reset();
+        if (slot.memoize && MemoizationMode == memo_shared)
+            slot.sharedMemo = std::make_unique<ConcurrentMemoTable>(slot.arity, MemoCapacity);
+        slot.memoGeneration = generation;
+
+        if (Backend == backend_ast || relower[i])
+        {
+            slot.ir.reset();
+            slot.native = nullptr;
+        }
+        slot.ready = Backend == backend_ast;
+        if (slot.ir || slot.native)
+            slot.ready = true;
+        PublishVersion(slot);
+    }
+}
+
+/// PrepareForEvaluation - Rerun the analyses if anything changed since the
+/// last evaluation: over each shared slot that changed and everything that
+/// calls it, whose purity, cost and results follow from its own, and over
+/// the private slots of each session that changed. Shared slots cannot call
+/// private ones, so a session's defs never change what was found for the
+/// shared table, which stays as SealSharedImage left it. May run while
+/// evaluations are in flight: they keep the versions they loaded.
+void PrepareForEvaluation()
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (DirtySlots.empty() && DirtySessions.empty())
+        return;
+
+    std::set<unsigned> members;
+    std::vector<unsigned> worklist(DirtySlots.begin(), DirtySlots.end());
+    while (!worklist.empty())
+    {
+        unsigned index = worklist.back();
+        worklist.pop_back();
+        if (members.insert(index).second)
+            worklist.insert(worklist.end(), FunctionSlots[index]->callers.begin(),
+                            FunctionSlots[index]->callers.end());
+    }
+    for (Session *session : DirtySessions)
+        for (const auto& entry : session->functions)
+            members.insert(entry.second);
+    DirtySlots.clear();
+    DirtySessions.clear();
+    AnalyseSlots(std::vector<unsigned>(members.begin(), members.end()));
+
+    if (EagerCompilation)
+        CompileAll();
+}
+
+/// FlushCompileBatch - Build code for the defs added to the batch since the
+/// last flush, with everything else that lacks it, as one module.
+void FlushCompileBatch()
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (BatchedDefinitions == 0)
+        return;
+    BatchedDefinitions = 0;
+    PrepareForEvaluation();
+    CompileAll();
+}
+
+/// AddToCompileBatch - Count a freshly installed def towards the batch, and
+/// flush the batch once it is full.
+void AddToCompileBatch()
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (CompileBatchSize == 0 || Backend == backend_ast)
+        return;
+    if (++BatchedDefinitions >= CompileBatchSize)
+        FlushCompileBatch();
+}
+
+/// SealSharedImage - Finish the shared table before sessions start: parse
+/// every deferred body, analyse everything and build all the code, so that no
+/// session ever has to change a shared slot.
+void SealSharedImage()
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    MaterializeAll();
+    PrepareForEvaluation();
+    CompileAll();
+}
+
+double EvaluateFunction(const FunctionSlot& slot, const double *args);
+
+/// EvaluateExpr - Evaluate a resolved expression with the given argument values.
+double EvaluateExpr(const ExprAST& expr, const double *args)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return static_cast<const NumberExprAST&>(expr).getValue();
+    case expr_variable:
+        return args[static_cast<const VariableExprAST&>(expr).getIndex()];
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        double L, R;
+        if (bin.isParallel() && EvaluationPool)
+        {
+            // Fork the LHS, evaluate the RHS here, then join. wait() runs other
+            // queued tasks rather than blocking, so nested forks cannot deadlock.
+            TaskGroup group;
+            EvaluationPool->spawn(group, [&] {
+                EpochGuard guard;
+                L = EvaluateExpr(bin.getLHS(), args);
+            });
+            R = EvaluateExpr(bin.getRHS(), args);
+            EvaluationPool->wait(group);
+        }
+        else
+        {
+            L = EvaluateExpr(bin.getLHS(), args);
+            R = EvaluateExpr(bin.getRHS(), args);
+        }
+        switch (bin.getOp())
+        {
+        case '+':
+            return L + R;
+        case '-':
+            return L - R;
+        case '*':
+            return L * R;
+        case '<':
+            return L < R ? 1.0 : 0.0;
+        }
+        return 0.0;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        const auto& callArgs = call.getArgs();
+
+        // Most calls take a handful of arguments; keep those off the heap.
+        double inlineArgs[8];
+        std::vector<double> heapArgs;
+        double *argv = inlineArgs;
+        if (callArgs.size() > 8)
+        {
+            heapArgs.resize(callArgs.size());
+            argv = heapArgs.data();
+        }
+        for (size_t i = 0; i < callArgs.size(); ++i)
+            argv[i] = EvaluateExpr(*callArgs[i], args);
+        return EvaluateFunction(CallSlot(call.getSlot()), argv);
+    }
+    }
+    return 0.0;
+}
+
+/// EvaluateIR - Run an IR function with the given argument values.
+double EvaluateIR(const IRFunction& function, const double *args)
+{
+    const std::vector<IRInst>& insts = function.insts;
+    double inlineValues[64];
+    std::vector<double> heapValues;
+    double *values = inlineValues;
+    if (insts.size() > 64)
+    {
+        heapValues.resize(insts.size());
+        values = heapValues.data();
+    }
+
+    for (size_t i = 0; i < insts.size(); ++i)
+    {
+        const IRInst& inst = insts[i];
+        const std::vector<unsigned>& ops = inst.operands;
+        switch (inst.op)
+        {
+        case ir_const:
+            values[i] = inst.value;
+            break;
+        case ir_arg:
+            values[i] = args[inst.index];
+            break;
+        case ir_add:
+            values[i] = values[ops[0]] + values[ops[1]];
+            break;
+        case ir_sub:
+            values[i] = values[ops[0]] - values[ops[1]];
+            break;
+        case ir_mul:
+            values[i] = values[ops[0]] * values[ops[1]];
+            break;
+        case ir_lt:
+            values[i] = values[ops[0]] < values[ops[1]] ? 1.0 : 0.0;
+            break;
+        case ir_copy:
+            values[i] = values[ops[0]];
+            break;
+        case ir_call:
+        {
+            double inlineArgs[8];
+            std::vector<double> heapArgs;
+            double *argv = inlineArgs;
+            if (ops.size() > 8)
+            {
+                heapArgs.resize(ops.size());
+                argv = heapArgs.data();
+            }
+            for (size_t k = 0; k < ops.size(); ++k)
+                argv[k] = values[ops[k]];
+            values[i] = EvaluateFunction(CallSlot(inst.index), argv);
+            break;
+        }
+        }
+    }
+    return values[function.result];
+}
+
+/// EvaluateBody - Run `version` of the body of `slot` on whichever backend it
+/// was prepared for.
+double EvaluateBody(const FunctionSlot& slot, const FunctionVersion& version, const double *args)
+{
+    if (!version.ready && BackgroundCompilation)
+        return EvaluateExpr(version.definition->getBody(), args);
+    const FunctionVersion& code = version.ready ? version : CompileFunction(slot.index);
+    if (code.native)
+        return code.native(args);
+    if (code.ir)
+        return EvaluateIR(*code.ir, args);
+    return EvaluateExpr(code.definition->getBody(), args);
+}
+
+/// EvaluateMemoized - Call a pure function through its memo table.
+double EvaluateMemoized(const FunctionSlot& slot, const FunctionVersion& version, const double *args)
+{
+    double result;
+    if (version.sharedMemo)
+    {
+        if (version.sharedMemo->lookup(args, result))
+            return result;
+        result = EvaluateBody(slot, version, args);
+        version.sharedMemo->insert(args, result);
+        return result;
+    }
+
+    struct ThreadMemo {
+        std::vector<std::unique_ptr<MemoTable> > tables; // by slot index
+        std::vector<unsigned> generations;               // memoGeneration of each table
+    };
+    static thread_local ThreadMemo memo;
+    if (memo.tables.size() <= slot.index)
+    {
+        memo.tables.resize(slot.index + 1);
+        memo.generations.resize(slot.index + 1);
+    }
+    if (!memo.tables[slot.index] || memo.generations[slot.index] != version.memoGeneration)
+    {
+        memo.tables[slot.index] = std::make_unique<MemoTable>(slot.arity, MemoCapacity);
+        memo.generations[slot.index] = version.memoGeneration;
+    }
+
+    uint64_t hash = MemoTable::Hash(args, slot.arity);
+    if (memo.tables[slot.index]->lookup(hash, args, result))
+        return result;
+    result = EvaluateBody(slot, version, args);
+    // The recursive call may have grown the vector, so index afresh. If a
+    // function was reanalysed meanwhile, the result may come from the old one.
+    if (memo.generations[slot.index] == version.memoGeneration)
+        memo.tables[slot.index]->insert(hash, args, result);
+    return result;
+}
+
+/// EvaluateFunction - Call the function held in `slot`, in the version that is
+/// current when the call is made. The caller holds an EpochGuard.
+double EvaluateFunction(const FunctionSlot& slot, const double *args)
+{
+    const FunctionVersion& version = *slot.version.load(std::memory_order_acquire);
+    if (version.isExtern)
+    {
+        if (version.intrinsic)
+            return EvaluateIntrinsic(version.intrinsic, args);
+        return CallExternAddress(version.externAddress, slot.arity, args);
+    }
+    if (version.memoize)
+        return EvaluateMemoized(slot, version, args);
+    return EvaluateBody(slot, version, args);
+}
+
+/// EvaluateTopLevel - Resolve and run an anonymous top-level expression.
+bool EvaluateTopLevel(FunctionAST& function, double& result)
+{
+    IRFunction ir;
+    {
+        std::lock_guard<std::recursive_mutex> lock(TableMutex);
+        if (!ResolveExpr(function.getBody(), function.getPrototype()))
+            return false;
+        // The compile thread builds batches itself, see compilequeue.h.
+        if (!BackgroundCompilation)
+            FlushCompileBatch();
+        PrepareForEvaluation();
+        if (Backend == backend_ir)
+            ir = LowerToIR("", 0, function.getBody());
+        else
+            MarkForkPoints(function.getBody());
+    }
+    EpochGuard guard;
+    if (Backend == backend_ir)
+        result = EvaluateIR(ir, nullptr);
+    else
+        result = EvaluateExpr(function.getBody(), nullptr);
+    return true;
+}
+
+#endif
@@ -0,0 +1,288 @@
+// Mid-level SSA IR
+
+#ifndef IR_H
+#define IR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+
+// Kaleidoscope has no control flow yet, so a function lowers to a single basic
+// block: a list of instructions, each defining the value named by its index,
+// whose operands always refer to earlier instructions. That is SSA form
+// without any phis. Unlike the AST, one value may feed any number of users,
+// so a repeated subexpression only needs computing once.
+
+enum IROpcode
+{
+    ir_const, // value
+    ir_arg,   // args[index]
+    ir_add,
+    ir_sub,
+    ir_mul,
+    ir_lt,
+    ir_call,  // FunctionSlots[index](operands...)
+    ir_copy,  // operands[0]; left behind by value numbering
+};
+
+struct IRInst
+{
+    IROpcode op;
+    double value = 0;
+    unsigned index = 0;
+    std::vector<unsigned> operands;
+};
+
+struct IRFunction
+{
+    std::string name;
+    unsigned numArgs = 0;
+    std::vector<IRInst> insts;
+    unsigned result = 0;
+};
+
+/// LowerExpr - Append the instructions computing `expr` to `function` and
+/// return the value holding its result.
+unsigned LowerExpr(const ExprAST& expr, IRFunction& function)
+{
+    IRInst inst;
+    switch (expr.getKind())
+    {
+    case expr_number:
+        inst.op = ir_const;
+        inst.value = static_cast<const NumberExprAST&>(expr).getValue();
+        break;
+    case expr_variable:
+        inst.op = ir_arg;
+        inst.index = static_cast<const VariableExprAST&>(expr).getIndex();
+        break;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        unsigned L = LowerExpr(bin.getLHS(), function);
+        unsigned R = LowerExpr(bin.getRHS(), function);
+        switch (bin.getOp())
+        {
+        case '+':
+            inst.op = ir_add;
+            break;
+        case '-':
+            inst.op = ir_sub;
+            break;
+        case '*':
+            inst.op = ir_mul;
+            break;
+        default:
+            inst.op = ir_lt;
+            break;
+        }
+        inst.operands = {L, R};
+        break;
+    }
+    case expr_call:
+    {
+        auto& call = static_cast<const CallExprAST&>(expr);
+        inst.op = ir_call;
+        inst.index = call.getSlot();
+        for (const auto& arg : call.getArgs())
+            inst.operands.push_back(LowerExpr(*arg, function));
+        break;
+    }
+    }
+    function.insts.push_back(std::move(inst));
+    return function.insts.size() - 1;
+}
+
+/// LowerFunction - Lower a resolved function body to IR.
+IRFunction LowerFunction(const std::string& name, unsigned numArgs, const ExprAST& body)
+{
+    IRFunction function;
+    function.name = name;
+    function.numArgs = numArgs;
+    function.result = LowerExpr(body, function);
+    return function;
+}
+
+/// ValueNumber - Global value numbering. Every instruction that computes the
+/// same value as an earlier one (same opcode, same constant or argument, same
+/// operand value numbers; operands of + and * in either order) becomes a copy
+/// of that earlier instruction, which is common-subexpression elimination.
+/// Operators on two constants fold to a constant on the way. Calls are only
+/// numbered when the callee is pure, since two calls into an extern are two
+/// separate effects. Returns the number of instructions replaced.
+unsigned ValueNumber(IRFunction& function, const std::vector<bool>& pureSlots)
+{
+    std::vector<IRInst>& insts = function.insts;
+    std::vector<unsigned> leader(insts.size());
+    std::map<std::vector<uint64_t>, unsigned> table;
+    unsigned changes = 0;
+
+    for (unsigned i = 0; i < insts.size(); ++i)
+    {
+        IRInst& inst = insts[i];
+        leader[i] = i;
+        if (inst.op == ir_copy)
+        {
+            leader[i] = leader[inst.operands[0]];
+            continue;
+        }
+        for (unsigned& operand : inst.operands)
+            operand = leader[operand];
+        if (inst.op == ir_call && !pureSlots[inst.index])
+            continue;
+
+        if (inst.op == ir_add || inst.op == ir_sub || inst.op == ir_mul || inst.op == ir_lt)
+        {
+            const IRInst& L = insts[inst.operands[0]];
+            const IRInst& R = insts[inst.operands[1]];
+            if (L.op == ir_const && R.op == ir_const)
+            {
+                double result = 0;
+                switch (inst.op)
+                {
+                case ir_add:
+                    result = L.value + R.value;
+                    break;
+                case ir_sub:
+                    result = L.value - R.value;
+                    break;
+                case ir_mul:
+                    result = L.value * R.value;
+                    break;
+                default:
+                    result = L.value < R.value ? 1.0 : 0.0;
+                    break;
+                }
+                inst.op = ir_const;
+                inst.value = result;
+                inst.operands.clear();
+                ++changes;
+            }
+            else if ((inst.op == ir_add || inst.op == ir_mul) && inst.operands[0] > inst.operands[1])
+                std::swap(inst.operands[0], inst.operands[1]);
+        }
+
+        std::vector<uint64_t> key = {(uint64_t)inst.op, inst.index};
+        uint64_t bits;
+        memcpy(&bits, &inst.value, sizeof(bits));
+        key.push_back(bits);
+        key.insert(key.end(), inst.operands.begin(), inst.operands.end());
+
+        auto found = table.find(key);
+        if (found == table.end())
+        {
+            table.emplace(std::move(key), i);
+            continue;
+        }
+        leader[i] = found->second;
+        inst.op = ir_copy;
+        inst.operands = {found->second};
+        ++changes;
+    }
+    return changes;
+}
+
+/// PropagateCopies - Make every use of a copy refer to the copied value
+/// directly, leaving the copies themselves dead. Returns the number of
+/// operands rewritten.
+unsigned PropagateCopies(IRFunction& function)
+{
+    std::vector<IRInst>& insts = function.insts;
+    std::vector<unsigned> source(insts.size());
+    unsigned changes = 0;
+    for (unsigned i = 0; i < insts.size(); ++i)
+    {
+        source[i] = insts[i].op == ir_copy ? source[insts[i].operands[0]] : i;
+        if (insts[i].op == ir_copy)
+            continue;
+        for (unsigned& operand : insts[i].operands)
+        {
+            if (source[operand] != operand)
+            {
+                operand = source[operand];
+                ++changes;
+            }
+        }
+    }
+    if (source[function.result] != function.result)
+    {
+        function.result = source[function.result];
+        ++changes;
+    }
+    return changes;
+}
+
+/// EliminateDeadCode - Drop instructions whose value is never used, keeping
+/// calls into impure functions for their effects, and renumber the rest.
+/// Returns the number of instructions removed.
+unsigned EliminateDeadCode(IRFunction& function, const std::vector<bool>& pureSlots)
+{
+    std::vector<IRInst>& insts = function.insts;
+    std::vector<bool> live(insts.size(), false);
+    live[function.result] = true;
+    for (unsigned i = insts.size(); i-- > 0;)
+    {
+        if (insts[i].op == ir_call && !pureSlots[insts[i].index])
+            live[i] = true;
+        if (!live[i])
+            continue;
+        for (unsigned operand : insts[i].operands)
+            live[operand] = true;
+    }
+
+    std::vector<unsigned> renumber(insts.size());
+    std::vector<IRInst> kept;
+    for (unsigned i = 0; i < insts.size(); ++i)
+    {
+        if (!live[i])
+            continue;
+        renumber[i] = kept.size();
+        kept.push_back(std::move(insts[i]));
+        for (unsigned& operand : kept.back().operands)
+            operand = renumber[operand];
+    }
+    unsigned removed = insts.size() - kept.size();
+    function.result = renumber[function.result];
+    insts = std::move(kept);
+    return removed;
+}
+
+/// OptimizeIR - Run the IR passes: value numbering turns redundant values into
+/// copies, copy propagation bypasses them, and dead-code elimination sweeps
+/// them away along with anything else unused.
+void OptimizeIR(IRFunction& function, const std::vector<bool>& pureSlots)
+{
+    ValueNumber(function, pureSlots);
+    PropagateCopies(function);
+    EliminateDeadCode(function, pureSlots);
+}
+
+/// PrintIR - Write a readable listing of `function` to `out`.
+void PrintIR(const IRFunction& function, const std::vector<std::string>& slotNames, FILE *out)
+{
+    static const char *names[] = {"const", "arg", "add", "sub", "mul", "lt", "call", "copy"};
+    fprintf(out, "def %s(%u args):\n", function.name.empty() ? "<top-level>" : function.name.c_str(),
+            function.numArgs);
+    for (unsigned i = 0; i < function.insts.size(); ++i)
+    {
+        const IRInst& inst = function.insts[i];
+        fprintf(out, "  %%%u = %s", i, names[inst.op]);
+        if (inst.op == ir_const)
+            fprintf(out, " %g", inst.value);
+        else if (inst.op == ir_arg)
+            fprintf(out, " %u", inst.index);
+        else if (inst.op == ir_call)
+            fprintf(out, " %s", slotNames[inst.index].c_str());
+        for (size_t k = 0; k < inst.operands.size(); ++k)
+            fprintf(out, "%s%%%u", k ? ", " : " ", inst.operands[k]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "  ret %%%u\n", function.result);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <cstdio>
 #include <string>
 
 // Each token returned by our lexer will either be one of the
@@ -25,23 +26,45 @@ enum Token
     tok_number = -5,
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+// The lexer and parser state is per thread, so that several clients of a
+// server can each run a script at the same time.
+static thread_local std::string IdentifierStr; // Filled in if tok_identifier
+static thread_local double NumVal;             // Filled in if tok_number
 
-/// gettok - Return the next token from standard input.
+/// TokenRecord - A token saved together with its IdentifierStr or NumVal, so
+/// that it can be handed to the parser again later.
+struct TokenRecord
+{
+    int tok;
+    std::string identifier;
+    double number;
+};
+
+/// LexerInput - Where gettok reads source text from.
+static thread_local FILE *LexerInput = stdin;
+/// LastChar - The character read after the last token, not yet consumed.
+static thread_local int LastChar = ' ';
+
+/// SetLexerInput - Read source text from `file` from the next token on.
+void SetLexerInput(FILE *file)
+{
+    LexerInput = file;
+    LastChar = ' ';
+}
+
+/// gettok - Return the next token from LexerInput.
 int gettok()
 {
-    static int LastChar = ' ';
 
     // Skip any whitespace.
     while (isspace(LastChar))
-        LastChar = getchar();
+        LastChar = getc(LexerInput);
 
     // Identifier: [a-zA-Z][a-zA-Z0-9]*
     if (isalpha(LastChar))
     {
         IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
+        while (isalnum((LastChar = getc(LexerInput))))
             IdentifierStr += LastChar;
 
         if (IdentifierStr == "def")
@@ -60,7 +83,7 @@ int gettok()
         do
         {
             NumStr += LastChar;
-            LastChar = getchar();
+            LastChar = getc(LexerInput);
         } while (isdigit(LastChar) || LastChar == '.');
 
         NumVal = strtod(NumStr.c_str(), 0);
@@ -72,7 +95,7 @@ int gettok()
     {
         // Comment until end of line.
         do
-            LastChar = getchar();
+            LastChar = getc(LexerInput);
         while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if (LastChar != EOF)
@@ -85,7 +108,7 @@ int gettok()
 
     // Otherwise, just return the character as its ascii value. (e.g. +)
     int thisChar = LastChar;
-    LastChar = getchar();
+    LastChar = getc(LexerInput);
     return thisChar;
 }
 
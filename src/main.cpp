@@ -1,14 +1,306 @@
+#include <cstring>
+#include <thread>
+
+#include <unistd.h>
+
+#include "batch.h"
+#include "cbackend.h"
+#include "compilequeue.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "server.h"
+#include "shard.h"
 
-int main() {
-    InstallBinaryOperators();
+/// Options - Command line settings for the driver.
+///
+///   --batch <function> <rows-file>  after reading the script from stdin,
+///                                   evaluate <function> once per row of
+///                                   <rows-file> and print the results in order
+///   --emit <file>                   after reading the script from stdin,
+///                                   compile its defs ahead of time into
+///                                   <file>: C source (.c), a relocatable
+///                                   object (.o) or a shared object (other)
+///   --emit-prefix <prefix>          prepend <prefix> to the name each def
+///                                   is exported under, e.g. so that a def
+///                                   may be called sin
+///   --workers <n>                   run --batch in <n> worker processes,
+///                                   restarting any that fail
+///   --shard-rows <n>                rows handed to a worker process at a time
+///   --vector-math                   run --batch a block of rows at a time,
+///                                   with vectorized exp, log, sin and cos
+///   --vecmath-report                print the accuracy of the vectorized math
+///                                   functions against libm and exit
+///   --threads <n>                   worker threads for batch and forked
+///                                   evaluation
+///   --fork-grain <cost>             estimated operand cost above which both
+///                                   sides of a binary expression run in
+///                                   parallel (0 disables forking)
+///   --memo <off|thread|shared>      memoize pure functions per thread or in
+///                                   tables shared by all threads
+///   --memo-capacity <n>             entries per function memo table
+///   --inline-threshold <nodes>      largest callee body that gets inlined
+///                                   (0 disables inlining)
+///   --inline-report                 print every inlining decision
+///   --backend <ast|ir|c>            evaluate the resolved AST, the optimized
+///                                   SSA IR lowered from it, or native code
+///                                   built by the system C compiler
+///   --eager-compile                 build code for every function before
+///                                   evaluating, not on each one's first call
+///   --compile-batch <n>             when the script is not read from a
+///                                   terminal, build the code for every <n>
+///                                   defs as one module
+///   --background-compile            install defs and build their code on
+///                                   a separate thread, so the next prompt
+///                                   comes back as soon as a def is parsed
+///   --compile-threads <n>           threads that lower or build a large set
+///                                   of functions at once
+///   --code-cache <dir>              keep modules built by the C backend in
+///                                   <dir> and reuse them across runs
+///   --huge-code-pages               back the memory native modules are
+///                                   loaded into with 2 MB pages
+///   --shared-cache <name>           coordinate through the POSIX shared
+///                                   memory object <name> with other
+///                                   processes using the same --code-cache,
+///                                   so that each module is compiled once
+///   --load <library>                search <library> for the functions named
+///                                   by extern declarations
+///   --shared-image <file>           load the defs in <file> into a sealed
+///                                   shared table first, and run the script
+///                                   in a session layered over it
+///   --serve <socket>                run as a daemon on the Unix domain
+///                                   socket <socket> instead of reading
+///                                   stdin, with a session per client
+///   --pipeline                      lex, parse and compile the script on
+///                                   three threads at once
+///   --lazy-parse                    parse each def's body on the first
+///                                   reference to it instead of when it is read
+///   --dump-ir                       print the optimized IR of each function
+///   --regalloc-report               print linear-scan spill statistics for
+///                                   each function's IR
+///   --disable-pass <name>           skip one of the AST optimization passes
+///   --time-passes                   print time spent in each AST pass on exit
+struct Options
+{
+    const char *batchFunction = nullptr;
+    const char *batchInput = nullptr;
+    const char *emitPath = nullptr;
+    const char *sharedImage = nullptr;
+    const char *servePath = nullptr;
+    unsigned threads = std::thread::hardware_concurrency();
+    unsigned workers = 0;
+    size_t compileBatch = 0;
+    bool backgroundCompile = false;
+    bool timePasses = false;
+    bool vecmathReport = false;
+};
+
+bool ParseMemoMode(const char *str, MemoMode& mode)
+{
+    if (!strcmp(str, "off"))
+        mode = memo_off;
+    else if (!strcmp(str, "thread"))
+        mode = memo_thread;
+    else if (!strcmp(str, "shared"))
+        mode = memo_shared;
+    else
+        return false;
+    return true;
+}
+
+bool ParseBackend(const char *str, ExecutionBackend& backend)
+{
+    if (!strcmp(str, "ast"))
+        backend = backend_ast;
+    else if (!strcmp(str, "ir"))
+        backend = backend_ir;
+    else if (!strcmp(str, "c"))
+        backend = backend_c;
+    else
+        return false;
+    return true;
+}
 
-    // Prime the first token.
-    fprintf(stderr, "ready> ");
-    getNextToken();
+bool ParseOptions(int argc, char **argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--batch") && i + 2 < argc)
+        {
+            options.batchFunction = argv[++i];
+            options.batchInput = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--emit") && i + 1 < argc)
+            options.emitPath = argv[++i];
+        else if (!strcmp(argv[i], "--emit-prefix") && i + 1 < argc)
+            EmitPrefix = argv[++i];
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc)
+            options.workers = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--shard-rows") && i + 1 < argc)
+            ShardRows = std::max<size_t>(1, (size_t)atol(argv[++i]));
+        else if (!strcmp(argv[i], "--vector-math"))
+            VectorMath = true;
+        else if (!strcmp(argv[i], "--vecmath-report"))
+            options.vecmathReport = true;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            options.threads = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--memo") && i + 1 < argc && ParseMemoMode(argv[i + 1], MemoizationMode))
+            ++i;
+        else if (!strcmp(argv[i], "--fork-grain") && i + 1 < argc)
+            ForkGrainSize = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--memo-capacity") && i + 1 < argc)
+            MemoCapacity = (size_t)atol(argv[++i]);
+        else if (!strcmp(argv[i], "--inline-threshold") && i + 1 < argc)
+            InlineThreshold = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--inline-report"))
+            InlineReport = true;
+        else if (!strcmp(argv[i], "--backend") && i + 1 < argc && ParseBackend(argv[i + 1], Backend))
+            ++i;
+        else if (!strcmp(argv[i], "--eager-compile"))
+            EagerCompilation = true;
+        else if (!strcmp(argv[i], "--compile-batch") && i + 1 < argc)
+            options.compileBatch = (size_t)atol(argv[++i]);
+        else if (!strcmp(argv[i], "--background-compile"))
+            options.backgroundCompile = true;
+        else if (!strcmp(argv[i], "--compile-threads") && i + 1 < argc)
+            CompileThreads = (unsigned)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--code-cache") && i + 1 < argc)
+            CodeCacheDir = argv[++i];
+        else if (!strcmp(argv[i], "--huge-code-pages"))
+            HugeCodePages = true;
+        else if (!strcmp(argv[i], "--shared-cache") && i + 1 < argc && OpenSharedCache(argv[i + 1]))
+            ++i;
+        else if (!strcmp(argv[i], "--load") && i + 1 < argc && LoadExternLibrary(argv[i + 1]))
+            ++i;
+        else if (!strcmp(argv[i], "--shared-image") && i + 1 < argc)
+            options.sharedImage = argv[++i];
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+            options.servePath = argv[++i];
+        else if (!strcmp(argv[i], "--pipeline"))
+            PipelinedParsing = true;
+        else if (!strcmp(argv[i], "--lazy-parse"))
+            LazyParsing = true;
+        else if (!strcmp(argv[i], "--dump-ir"))
+            DumpIR = true;
+        else if (!strcmp(argv[i], "--regalloc-report"))
+            RegAllocReport = true;
+        else if (!strcmp(argv[i], "--disable-pass") && i + 1 < argc && SetASTPassEnabled(argv[i + 1], false))
+            ++i;
+        else if (!strcmp(argv[i], "--time-passes"))
+            options.timePasses = true;
+        else
+        {
+            fprintf(stderr,
+                    "Usage: %s [--batch <function> <rows-file>] [--emit <file>]\n"
+                    "          [--emit-prefix <prefix>] [--workers <n>] [--shard-rows <n>]\n"
+                    "          [--vector-math] [--vecmath-report]\n"
+                    "          [--threads <n>] [--fork-grain <cost>]\n"
+                    "          [--memo <off|thread|shared>] [--memo-capacity <n>]\n"
+                    "          [--inline-threshold <nodes>] [--inline-report]\n"
+                    "          [--backend <ast|ir|c>] [--eager-compile] [--background-compile]\n"
+                    "          [--compile-batch <n>] [--compile-threads <n>]\n"
+                    "          [--code-cache <dir>] [--huge-code-pages] [--shared-cache <name>]\n"
+                    "          [--load <library>] [--shared-image <file>] [--serve <socket>]\n"
+                    "          [--pipeline] [--lazy-parse] [--dump-ir] [--regalloc-report]\n"
+                    "          [--disable-pass <name>] [--time-passes]\n",
+                    argv[0]);
+            return false;
+        }
+    }
+    if (SharedCache && CodeCacheDir.empty())
+        return LogErrorR("--shared-cache coordinates builds into the --code-cache directory, which is not set");
+    return true;
+}
 
-    // Run the main "interpreter loop" now.
-    MainLoop();
+/// RunBatch - Evaluate the requested function over every row of the input file.
+int RunBatch(const Options& options, ThreadPool& pool)
+{
+    const FunctionSlot *slot = FindFunction(options.batchFunction);
+    if (!slot || slot->isExtern)
+    {
+        LogErrorR(std::string("Unknown function referenced '") + options.batchFunction + "'");
+        return 1;
+    }
 
+    FILE *input = fopen(options.batchInput, "r");
+    if (!input)
+    {
+        LogErrorR(std::string("Cannot open batch input '") + options.batchInput + "'");
+        return 1;
+    }
+    if (options.workers)
+    {
+        // Each worker gets its share of the threads.
+        unsigned threads = std::max(1u, options.threads / options.workers);
+        bool ok = EvaluateShardedBatch(options.batchFunction, input, options.workers, threads, stdout);
+        fclose(input);
+        return ok ? 0 : 1;
+    }
+
+    std::vector<double> rows;
+    size_t numRows;
+    bool ok = ReadBatchRows(input, slot->arity, rows, numRows);
+    fclose(input);
+    if (!ok)
+        return 1;
+
+    std::vector<double> results;
+    if (!EvaluateBatch(options.batchFunction, rows, numRows, results, pool))
+        return 1;
+    for (double result : results)
+        printf("%.17g\n", result);
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+        return 1;
+
+    if (options.vecmathReport)
+    {
+        PrintVectorMathReport(stderr);
+        return 0;
+    }
+
+    InstallBinaryOperators();
+    // At a terminal, a full batch would stall the prompt of the def that
+    // filled it.
+    if (!isatty(STDIN_FILENO))
+        CompileBatchSize = options.compileBatch;
+
+    ThreadPool pool(options.threads);
+    EvaluationPool = &pool;
+
+    if (options.sharedImage && !LoadSharedImage(options.sharedImage))
+        return 1;
+    if (options.backgroundCompile)
+        StartBackgroundCompilation();
+    if (options.servePath)
+        return RunServer(options.servePath, options.threads, pool);
+    Session session;
+    if (options.sharedImage)
+        CurrentSession = &session;
+
+    if (PipelinedParsing)
+        RunPipeline(stdin);
+    else
+    {
+        // Prime the first token.
+        fprintf(stderr, "ready> ");
+        getNextToken();
+
+        // Run the main "interpreter loop" now.
+        MainLoop();
+    }
+    FinishBackgroundCompilation();
+
+    int status = 0;
+    if (options.emitPath && !CompileModuleAOT(options.emitPath))
+        status = 1;
+    if (!status && options.batchFunction)
+        status = RunBatch(options, pool);
+
+    if (options.timePasses)
+        PrintASTPassReport(stderr);
+    return status;
+}
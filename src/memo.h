@@ -0,0 +1,120 @@
+// Memo tables for pure functions
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// MemoMode - Where memoized results are kept, if anywhere.
+enum MemoMode
+{
+    memo_off,    // never memoize
+    memo_thread, // one table per function per thread, no synchronisation
+    memo_shared, // one table per function shared by all threads, lock-striped
+};
+
+/// MemoTable - A bounded, direct-mapped cache from argument tuples to results.
+/// Keys compare the bit patterns of the arguments, so -0.0 and 0.0 are distinct
+/// and a NaN argument can hit. A colliding insert evicts the previous entry.
+class MemoTable {
+  private:
+    size_t arity;
+    size_t mask;
+    std::vector<uint64_t> keys; // arity words per entry
+    std::vector<double> values;
+    std::vector<bool> filled;
+
+  public:
+    MemoTable(size_t arity, size_t capacity)
+    : arity(arity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        keys.resize(size * arity);
+        values.resize(size);
+        filled.resize(size);
+    }
+
+    static uint64_t Hash(const double *args, size_t arity)
+    {
+        uint64_t h = 0x243f6a8885a308d3ull;
+        for (size_t i = 0; i < arity; ++i)
+        {
+            uint64_t bits;
+            memcpy(&bits, &args[i], sizeof(bits));
+            h ^= bits + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    bool lookup(uint64_t hash, const double *args, double& result) const
+    {
+        size_t entry = hash & mask;
+        if (!filled[entry] || (arity && memcmp(&keys[entry * arity], args, arity * sizeof(double)) != 0))
+            return false;
+        result = values[entry];
+        return true;
+    }
+
+    void insert(uint64_t hash, const double *args, double result)
+    {
+        size_t entry = hash & mask;
+        if (arity)
+            memcpy(&keys[entry * arity], args, arity * sizeof(double));
+        values[entry] = result;
+        filled[entry] = true;
+    }
+
+    void clear() { filled.assign(filled.size(), false); }
+};
+
+/// ConcurrentMemoTable - A MemoTable split into independently locked stripes,
+/// chosen by the high bits of the key hash, for sharing between threads.
+class ConcurrentMemoTable {
+  private:
+    static const unsigned NumStripes = 64;
+
+    struct Stripe {
+        std::mutex mutex;
+        MemoTable table;
+        Stripe(size_t arity, size_t capacity) : table(arity, capacity) {}
+    };
+    std::vector<std::unique_ptr<Stripe> > stripes;
+    size_t arity;
+
+  public:
+    ConcurrentMemoTable(size_t arity, size_t capacity)
+    : arity(arity)
+    {
+        size_t perStripe = capacity / NumStripes ? capacity / NumStripes : 1;
+        for (unsigned i = 0; i < NumStripes; ++i)
+            stripes.push_back(std::make_unique<Stripe>(arity, perStripe));
+    }
+
+    bool lookup(const double *args, double& result)
+    {
+        uint64_t hash = MemoTable::Hash(args, arity);
+        Stripe& stripe = *stripes[hash >> 58];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        return stripe.table.lookup(hash, args, result);
+    }
+
+    void insert(const double *args, double result)
+    {
+        uint64_t hash = MemoTable::Hash(args, arity);
+        Stripe& stripe = *stripes[hash >> 58];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        stripe.table.insert(hash, args, result);
+    }
+};
+
+#endif
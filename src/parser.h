@@ -1,13 +1,19 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <algorithm>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "ast.h"
+#include "inliner.h"
+#include "interpreter.h"
 #include "lexer.h"
+#include "passes.h"
+#include "ring.h"
 
 // Forward declarations
 std::unique_ptr<ExprAST> ParseExpression();
@@ -15,10 +21,41 @@ std::unique_ptr<ExprAST> ParseBinOpRHS(int, std::unique_ptr<ExprAST>);
 
 // Every function in our parser will assume that CurTok
 // is the current token that needs to be parsed.
-static int CurTok;
+static thread_local int CurTok;
+/// ReplayTokens, ReplayPosition - While set, getNextToken reads these recorded
+/// tokens instead of the lexer, and returns tok_eof after the last one.
+static thread_local const std::vector<TokenRecord> *ReplayTokens = nullptr;
+static thread_local size_t ReplayPosition = 0;
+/// TokenRingSize, TokenStream - Otherwise, while set, getNextToken takes the
+/// tokens a lexer thread pushes here (see pipeline.h).
+static const size_t TokenRingSize = 1024;
+static thread_local SPSCRing<TokenRecord, TokenRingSize> *TokenStream = nullptr;
 int getNextToken()
 {
-    return CurTok = gettok();
+    if (!ReplayTokens && !TokenStream)
+        return CurTok = gettok();
+    TokenRecord streamed;
+    const TokenRecord *next;
+    if (ReplayTokens)
+    {
+        if (ReplayPosition == ReplayTokens->size())
+            return CurTok = tok_eof;
+        next = &(*ReplayTokens)[ReplayPosition++];
+    }
+    else
+    {
+        // The lexer thread stops after tok_eof, so never wait past it.
+        if (CurTok == tok_eof)
+            return CurTok;
+        streamed = TokenStream->pop();
+        next = &streamed;
+    }
+    const TokenRecord& record = *next;
+    if (record.tok == tok_identifier)
+        IdentifierStr = record.identifier;
+    else if (record.tok == tok_number)
+        NumVal = record.number;
+    return CurTok = record.tok;
 }
 
 /// LogError* - These are little helper functions for error handling.
@@ -154,10 +191,12 @@ int GetTokPrecendence()
         LogError("Binary operators are not installed yet.");
         return -2;
     }
-    int tokPrec = BinopPrecedence[CurTok];
-    if (tokPrec <= 0)
+    // find() rather than operator[], which would insert: scripts are parsed on
+    // several threads at once, see RunScript.
+    auto it = BinopPrecedence.find(CurTok);
+    if (it == BinopPrecedence.end() || it->second <= 0)
         return -1;
-    return tokPrec;
+    return it->second;
 }
 
 // ======================================================================================
@@ -271,57 +310,436 @@ std::unique_ptr<FunctionAST> ParseTopLevelExpr()
     return nullptr;
 }
 
+// Deferred function bodies
+// ======================================================================================
+
+// With LazyParsing, a definition only has its prototype parsed up front. The
+// body is run through a scanner that recognizes the same grammar as the parser
+// and reports the same syntax errors, but builds no AST: it only records the
+// tokens. The recorded body is parsed, inlined into and resolved when the
+// function is first referenced, so a large library of defs that a script never
+// calls costs little more than lexing it. The body then binds to the callee
+// definitions visible at that point rather than at the point of definition.
+
+/// LazyParsing - Defer parsing of def bodies until their first reference.
+static bool LazyParsing = false;
+
+/// RecordToken - Append the current token to `tokens` and move past it.
+void RecordToken(std::vector<TokenRecord>& tokens)
+{
+    tokens.push_back({CurTok, CurTok == tok_identifier ? IdentifierStr : std::string(), NumVal});
+    getNextToken();
+}
+
+bool ScanExpression(const std::vector<std::string>& params, std::vector<TokenRecord>& tokens);
+
+/// ScanPrimary - Record one primary, checking it as ParsePrimary would.
+/// Variable references are checked against the prototype's parameters here,
+/// since that needs nothing but the prototype.
+bool ScanPrimary(const std::vector<std::string>& params, std::vector<TokenRecord>& tokens)
+{
+    switch (CurTok)
+    {
+    default:
+        LogError("Unknown token when expecting an expression.");
+        return false;
+    case tok_number:
+        RecordToken(tokens);
+        return true;
+    case '(':
+        RecordToken(tokens);
+        if (!ScanExpression(params, tokens))
+            return false;
+        if (CurTok != ')')
+        {
+            LogError("expected ')'");
+            return false;
+        }
+        RecordToken(tokens);
+        return true;
+    case tok_identifier:
+        break;
+    }
+
+    std::string idName = IdentifierStr;
+    RecordToken(tokens);
+    if (CurTok != '(')
+    {
+        if (std::find(params.begin(), params.end(), idName) == params.end())
+            return LogErrorR("Unknown variable name '" + idName + "'");
+        return true;
+    }
+
+    RecordToken(tokens); // (
+    if (CurTok != ')')
+    {
+        while (true)
+        {
+            if (!ScanExpression(params, tokens))
+                return false;
+            if (CurTok == ')')
+                break;
+            if (CurTok != ',')
+            {
+                LogError("Expected ')' or ',' in argument list");
+                return false;
+            }
+            RecordToken(tokens);
+        }
+    }
+    RecordToken(tokens); // )
+    return true;
+}
+
+/// ScanExpression - Record a primary and every (binop, primary) pair after
+/// it. Precedence only shapes the tree, so the scanner can ignore it.
+bool ScanExpression(const std::vector<std::string>& params, std::vector<TokenRecord>& tokens)
+{
+    if (!ScanPrimary(params, tokens))
+        return false;
+    while (GetTokPrecendence() > 0)
+    {
+        RecordToken(tokens);
+        if (!ScanPrimary(params, tokens))
+            return false;
+    }
+    return true;
+}
+
+bool DefineParsedFunction(std::unique_ptr<FunctionAST> function);
+
+/// RebuildInliners - Redo every def that holds an inlined copy of `slot`
+/// from the body it was parsed with, now that `slot` has a new definition.
+/// Those defs are redefined in turn, so defs that inlined them follow. Nothing
+/// else needs rebuilding: other callers reach `slot` through its slot index.
+void RebuildInliners(const FunctionSlot& slot)
+{
+    std::set<unsigned> inliners = slot.inlinedInto;
+    for (unsigned index : inliners)
+    {
+        const FunctionSlot& inliner = *FunctionSlots[index];
+        if (!inliner.definition || !inliner.source)
+            continue;
+        auto prototype = std::make_unique<PrototypeAST>(inliner.name, inliner.definition->getPrototype().getArgs());
+        if (InlineReport)
+            fprintf(stderr, "inline: rebuilding %s after redefinition of %s\n", inliner.name.c_str(),
+                    slot.name.c_str());
+        DefineParsedFunction(std::make_unique<FunctionAST>(std::move(prototype), CloneExpr(*inliner.source)));
+    }
+}
+
+/// DefineParsedFunction - Optimize a freshly parsed def and install it, then
+/// rebuild the defs that inlined an earlier definition of it.
+bool DefineParsedFunction(std::unique_ptr<FunctionAST> function)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    std::string name = function->getPrototype().getName();
+    std::unique_ptr<ExprAST> source = CloneExpr(function->getBody());
+    std::vector<unsigned> inlined;
+    InlineCalls(*function, &inlined);
+    RunASTPasses(*function);
+    if (inlined.empty())
+        source.reset();
+    if (!DefineFunction(std::move(function), std::move(source), std::move(inlined)))
+        return false;
+    RebuildInliners(*FindFunction(name));
+    return true;
+}
+
+/// ParseRecordedExpression - Parse an expression from recorded tokens, then
+/// put the main token stream back where it was.
+std::unique_ptr<ExprAST> ParseRecordedExpression(const std::vector<TokenRecord>& tokens)
+{
+    int savedTok = CurTok;
+    std::string savedIdentifier = IdentifierStr;
+    double savedNumber = NumVal;
+    const std::vector<TokenRecord> *savedReplay = ReplayTokens;
+    size_t savedPosition = ReplayPosition;
+    ReplayTokens = &tokens;
+    ReplayPosition = 0;
+    getNextToken();
+    std::unique_ptr<ExprAST> expression = ParseExpression();
+    ReplayTokens = savedReplay;
+    ReplayPosition = savedPosition;
+    CurTok = savedTok;
+    IdentifierStr = savedIdentifier;
+    NumVal = savedNumber;
+    return expression;
+}
+
+/// MaterializedSlots, MaterializeDepth - Slots given a body by the
+/// MaterializeFunction calls still in progress, and how deeply those nest.
+static std::vector<FunctionSlot *> MaterializedSlots;
+static unsigned MaterializeDepth = 0;
+
+/// MaterializeFunction - Parse the deferred body of `slot` from its recorded
+/// tokens and install it. Resolving the body may materialize its callees in
+/// turn, and those may call back into `slot` before it is installed. So if
+/// `slot` fails to resolve, every slot materialized since it started goes back
+/// to being deferred with it, and the next reference tries again.
+bool MaterializeFunction(FunctionSlot& slot)
+{
+    std::lock_guard<std::recursive_mutex> lock(TableMutex);
+    if (!slot.deferred)
+        return true; // materialized by another thread meanwhile
+    slot.deferred = false;
+    // Names in the body mean what they mean to the session that wrote it.
+    Session *savedSession = CurrentSession;
+    CurrentSession = slot.session;
+    size_t firstMaterialized = MaterializedSlots.size();
+    ++MaterializeDepth;
+
+    std::unique_ptr<ExprAST> body = ParseRecordedExpression(slot.deferredBody);
+    bool ok = false;
+    if (body)
+    {
+        auto prototype = std::make_unique<PrototypeAST>(slot.name, slot.deferredArgs);
+        ok = DefineParsedFunction(std::make_unique<FunctionAST>(std::move(prototype), std::move(body)));
+    }
+    CurrentSession = savedSession;
+    if (ok)
+        MaterializedSlots.push_back(&slot);
+    else
+    {
+        slot.deferred = true;
+        for (size_t i = firstMaterialized; i < MaterializedSlots.size(); ++i)
+        {
+            FunctionSlot& other = *MaterializedSlots[i];
+            other.deferred = true;
+            UnlinkDependencies(other);
+            other.definition.reset();
+            other.ready = false;
+            other.ir.reset();
+            other.native = nullptr;
+            PublishVersion(other);
+            MarkAnalysisDirty(other);
+        }
+        MaterializedSlots.resize(firstMaterialized);
+        MarkAnalysisDirty(slot);
+    }
+
+    // Once the outermost call is done, the installed bodies are final and
+    // their recordings can go.
+    if (--MaterializeDepth == 0)
+    {
+        for (FunctionSlot *done : MaterializedSlots)
+        {
+            done->deferredArgs.clear();
+            std::vector<TokenRecord>().swap(done->deferredBody);
+        }
+        MaterializedSlots.clear();
+    }
+    return ok;
+}
+
+// ======================================================================================
+
 // Top-Level parsing
 
-void HandleDefinition() {
-    if (ParseDefinition()) {
-        fprintf(stderr, "Parsed a function definition.\n");
-    } else {
+// Each statement is handled in two halves. ParseTopLevelItem parses it into a
+// TopLevelItem and touches nothing but the parser's own state; RunTopLevelItem
+// installs or evaluates it. MainLoop runs both halves in turn, and the
+// pipeline in pipeline.h runs them on different threads.
+
+/// TopLevelKind - What a parsed statement is. top_none is a ';' or a statement
+/// that failed to parse, and top_eof the end of input.
+enum TopLevelKind
+{
+    top_none,
+    top_definition,
+    top_deferred_definition,
+    top_extern,
+    top_expression,
+    top_eof,
+};
+
+/// TopLevelItem - One parsed statement, waiting to be run.
+struct TopLevelItem
+{
+    TopLevelKind kind = top_none;
+    std::unique_ptr<FunctionAST> function;   // top_definition, top_expression
+    std::unique_ptr<PrototypeAST> prototype; // top_deferred_definition, top_extern
+    std::vector<TokenRecord> body;           // top_deferred_definition
+};
+
+/// ParseTopLevelItem - Parse the statement at CurTok into `item`. Under
+/// LazyParsing a def's body is only scanned and recorded.
+void ParseTopLevelItem(TopLevelItem& item) {
+    switch (CurTok) {
+    case tok_eof:
+        item.kind = top_eof;
+        return;
+    case ';': // ignore top-level semicolons.
+        getNextToken();
+        return;
+    case tok_def:
+        if (LazyParsing) {
+            getNextToken(); // consume 'def'.
+            item.prototype = ParsePrototype();
+            if (item.prototype && ScanExpression(item.prototype->getArgs(), item.body))
+                item.kind = top_deferred_definition;
+        } else if ((item.function = ParseDefinition())) {
+            item.kind = top_definition;
+        }
+        break;
+    case tok_extern:
+        if ((item.prototype = ParseExtern()))
+            item.kind = top_extern;
+        break;
+    default:
+        if ((item.function = ParseTopLevelExpr()))
+            item.kind = top_expression;
+        break;
+    }
+    if (item.kind == top_none) {
         // Skip token for error recovery.
         getNextToken();
     }
 }
 
-void HandleExtern() {
-    if (ParseExtern()) {
-        fprintf(stderr, "Parsed an extern\n");
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+/// QuietStatements - Set on a thread running statements for RunScript, whose
+/// caller gets the outcomes back: no prompt, and no echo of what became of
+/// each statement. Errors are still reported.
+static thread_local bool QuietStatements = false;
+
+/// HandleDeferredDefinition - Install a def read under LazyParsing. A name
+/// that already has a parsed body may have call sites bound to it, so
+/// redefining it is not deferred: its recorded body is parsed right away.
+void HandleDeferredDefinition(TopLevelItem& item) {
+    if (!QuietStatements)
+        fprintf(stderr, "Parsed a function definition.\n");
+    FunctionSlot *slot = FindFunction(item.prototype->getName());
+    if (slot && !slot->deferred) {
+        std::unique_ptr<ExprAST> expression = ParseRecordedExpression(item.body);
+        if (expression &&
+            DefineParsedFunction(std::make_unique<FunctionAST>(std::move(item.prototype), std::move(expression))))
+            AddToCompileBatch();
+        return;
     }
+    DeferFunction(item.prototype->getName(), item.prototype->getArgs(), std::move(item.body));
+}
+
+void HandleDefinition(TopLevelItem& item) {
+    if (!QuietStatements)
+        fprintf(stderr, "Parsed a function definition.\n");
+    if (DefineParsedFunction(std::move(item.function)))
+        AddToCompileBatch();
 }
 
-void HandleTopLevelExpression() {
+void HandleExtern(TopLevelItem& item) {
+    if (!QuietStatements)
+        fprintf(stderr, "Parsed an extern\n");
+    DeclareExtern(*item.prototype);
+}
+
+/// TopLevelResult - The outcome of one top-level expression.
+struct TopLevelResult
+{
+    bool ok;
+    double value;
+};
+/// ScriptResults - While set, HandleTopLevelExpression also records every
+/// outcome here, for RunScript.
+static thread_local std::vector<TopLevelResult> *ScriptResults = nullptr;
+
+void HandleTopLevelExpression(TopLevelItem& item) {
     // Evaluate a top-level expression into an anonymous function.
-    if (ParseTopLevelExpr()) {
+    if (!QuietStatements)
         fprintf(stderr, "Parsed a top-level expr\n");
+    std::unique_ptr<FunctionAST> function = std::move(item.function);
+    {
+        std::lock_guard<std::recursive_mutex> lock(TableMutex);
+        InlineCalls(*function);
+        RunASTPasses(*function);
+    }
+    double result = 0;
+    bool ok = EvaluateTopLevel(*function, result);
+    if (ok && !QuietStatements)
+        fprintf(stderr, "Evaluated to %f\n", result);
+    if (ScriptResults)
+        ScriptResults->push_back({ok, result});
+}
+
+/// HandleTopLevelItem - Install or evaluate a parsed statement.
+void HandleTopLevelItem(TopLevelItem& item) {
+    switch (item.kind) {
+    case top_definition:
+        HandleDefinition(item);
+        break;
+    case top_deferred_definition:
+        HandleDeferredDefinition(item);
+        break;
+    case top_extern:
+        HandleExtern(item);
+        break;
+    case top_expression:
+        HandleTopLevelExpression(item);
+        break;
+    case top_none:
+    case top_eof:
+        break;
+    }
+}
+
+void SubmitDefinition(TopLevelItem& item);
+void AwaitDefinitions(Session *session);
+
+/// RunTopLevelItem - Handle a parsed statement, or under BackgroundCompilation
+/// queue it for the compile thread unless it is a top-level expression. Those
+/// wait until every statement their session wrote before them has been
+/// installed.
+void RunTopLevelItem(TopLevelItem& item) {
+    if (!BackgroundCompilation || item.kind == top_none || item.kind == top_eof) {
+        HandleTopLevelItem(item);
+    } else if (item.kind != top_expression) {
+        SubmitDefinition(item);
     } else {
-        // Skip token for error recovery.
-        getNextToken();
+        AwaitDefinitions(CurrentSession);
+        HandleTopLevelItem(item);
     }
 }
 
 void MainLoop() {
     while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok)
-        {
-        case tok_eof:
+        if (!QuietStatements)
+            fprintf(stderr, "ready> ");
+        TopLevelItem item;
+        ParseTopLevelItem(item);
+        if (item.kind == top_eof)
             return;
-        case ';': // ignore top-level semicolons.
-            getNextToken();
-            break;
-        case tok_def:
-            HandleDefinition();
-            break;
-        case tok_extern:
-            HandleExtern();
-            break;
-        default:
-            HandleTopLevelExpression();
-            break;
-        }
+        RunTopLevelItem(item);
     }
 }
 
+/// RunScript - Run every statement in `input` on the calling thread, in its
+/// CurrentSession, and return the outcomes of the top-level expressions.
+std::vector<TopLevelResult> RunScript(FILE *input)
+{
+    std::vector<TopLevelResult> results;
+    FILE *savedInput = LexerInput;
+    bool savedQuiet = QuietStatements;
+    SetLexerInput(input);
+    ScriptResults = &results;
+    QuietStatements = true;
+    getNextToken();
+    MainLoop();
+    QuietStatements = savedQuiet;
+    ScriptResults = nullptr;
+    SetLexerInput(savedInput);
+    return results;
+}
+
+/// LoadSharedImage - Run the file at `path` into the shared function table
+/// and seal it, see Session. Must come before any session starts.
+bool LoadSharedImage(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return LogErrorR(std::string("Cannot open '") + path + "'");
+    RunScript(file);
+    fclose(file);
+    SealSharedImage();
+    return true;
+}
+
 #endif
\ No newline at end of file
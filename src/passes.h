@@ -0,0 +1,323 @@
+// AST optimization passes
+
+#ifndef PASSES_H
+#define PASSES_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "callgraph.h"
+
+// Every rewrite here must give bit-identical results to the unoptimized tree
+// under IEEE arithmetic, so rules like x+0 -> x (wrong for x = -0) or
+// x*0 -> 0 (wrong for NaN and infinities) are deliberately absent.
+
+/// IsNumber - Whether `expr` is the literal `value`, compared bit for bit so
+/// that 0.0 does not match -0.0.
+bool IsNumber(const ExprAST& expr, double value)
+{
+    if (expr.getKind() != expr_number)
+        return false;
+    double literal = static_cast<const NumberExprAST&>(expr).getValue();
+    return memcmp(&literal, &value, sizeof(double)) == 0;
+}
+
+/// canonicalize - Order the operands of commutative operators: calls, then
+/// nested operators, then variables by name, then constants. Constants end up
+/// on the right, where the later passes look for them, and a+b and b+a become
+/// the same tree. Operands that both make calls keep their order, so that
+/// calls into externs still happen in source order.
+unsigned OperandRank(const ExprAST& expr)
+{
+    switch (expr.getKind())
+    {
+    case expr_call:
+        return 0;
+    case expr_binary:
+        return 1;
+    case expr_variable:
+        return 2;
+    case expr_number:
+        return 3;
+    }
+    return 0;
+}
+
+unsigned CanonicalizeExpr(ExprAST& expr)
+{
+    unsigned changes = 0;
+    if (expr.getKind() == expr_call)
+    {
+        for (auto& arg : static_cast<CallExprAST&>(expr).getArgs())
+            changes += CanonicalizeExpr(*arg);
+        return changes;
+    }
+    if (expr.getKind() != expr_binary)
+        return 0;
+
+    auto& bin = static_cast<BinaryExprAST&>(expr);
+    changes += CanonicalizeExpr(bin.getLHS()) + CanonicalizeExpr(bin.getRHS());
+    if (bin.getOp() != '+' && bin.getOp() != '*')
+        return changes;
+    if (ContainsCall(bin.getLHS()) && ContainsCall(bin.getRHS()))
+        return changes;
+
+    bool swap = OperandRank(bin.getLHS()) > OperandRank(bin.getRHS());
+    if (bin.getLHS().getKind() == expr_variable && bin.getRHS().getKind() == expr_variable)
+        swap = static_cast<VariableExprAST&>(bin.getLHS()).getName() >
+               static_cast<VariableExprAST&>(bin.getRHS()).getName();
+    if (swap)
+    {
+        std::swap(bin.getLHSPtr(), bin.getRHSPtr());
+        ++changes;
+    }
+    return changes;
+}
+
+unsigned CanonicalizePass(FunctionAST& function)
+{
+    return CanonicalizeExpr(function.getBody());
+}
+
+/// constfold - Replace operators whose operands are both literals with the
+/// literal result.
+unsigned ConstantFoldExpr(std::unique_ptr<ExprAST>& expr)
+{
+    unsigned changes = 0;
+    if (expr->getKind() == expr_call)
+    {
+        for (auto& arg : static_cast<CallExprAST&>(*expr).getArgs())
+            changes += ConstantFoldExpr(arg);
+        return changes;
+    }
+    if (expr->getKind() != expr_binary)
+        return 0;
+
+    auto& bin = static_cast<BinaryExprAST&>(*expr);
+    changes += ConstantFoldExpr(bin.getLHSPtr()) + ConstantFoldExpr(bin.getRHSPtr());
+    if (bin.getLHS().getKind() != expr_number || bin.getRHS().getKind() != expr_number)
+        return changes;
+
+    double L = static_cast<NumberExprAST&>(bin.getLHS()).getValue();
+    double R = static_cast<NumberExprAST&>(bin.getRHS()).getValue();
+    double result;
+    switch (bin.getOp())
+    {
+    case '+':
+        result = L + R;
+        break;
+    case '-':
+        result = L - R;
+        break;
+    case '*':
+        result = L * R;
+        break;
+    case '<':
+        result = L < R ? 1.0 : 0.0;
+        break;
+    default:
+        return changes; // left for the resolver to reject
+    }
+    expr = std::make_unique<NumberExprAST>(result);
+    return changes + 1;
+}
+
+unsigned ConstantFoldPass(FunctionAST& function)
+{
+    return ConstantFoldExpr(function.getBodyPtr());
+}
+
+/// simplify - Algebraic identities: x*1 and 1*x become x, x-0 becomes x.
+unsigned SimplifyExpr(std::unique_ptr<ExprAST>& expr)
+{
+    unsigned changes = 0;
+    if (expr->getKind() == expr_call)
+    {
+        for (auto& arg : static_cast<CallExprAST&>(*expr).getArgs())
+            changes += SimplifyExpr(arg);
+        return changes;
+    }
+    if (expr->getKind() != expr_binary)
+        return 0;
+
+    auto& bin = static_cast<BinaryExprAST&>(*expr);
+    changes += SimplifyExpr(bin.getLHSPtr()) + SimplifyExpr(bin.getRHSPtr());
+    if ((bin.getOp() == '*' && IsNumber(bin.getRHS(), 1.0)) || (bin.getOp() == '-' && IsNumber(bin.getRHS(), 0.0)))
+    {
+        std::unique_ptr<ExprAST> operand = std::move(bin.getLHSPtr());
+        expr = std::move(operand);
+        return changes + 1;
+    }
+    if (bin.getOp() == '*' && IsNumber(bin.getLHS(), 1.0))
+    {
+        std::unique_ptr<ExprAST> operand = std::move(bin.getRHSPtr());
+        expr = std::move(operand);
+        return changes + 1;
+    }
+    return changes;
+}
+
+unsigned SimplifyPass(FunctionAST& function)
+{
+    return SimplifyExpr(function.getBodyPtr());
+}
+
+/// strength - Replace a multiplication of a variable by 2 with an addition
+/// of the variable to itself. Only variables are duplicated, since copying a
+/// larger operand would evaluate it twice.
+unsigned StrengthReduceExpr(std::unique_ptr<ExprAST>& expr)
+{
+    unsigned changes = 0;
+    if (expr->getKind() == expr_call)
+    {
+        for (auto& arg : static_cast<CallExprAST&>(*expr).getArgs())
+            changes += StrengthReduceExpr(arg);
+        return changes;
+    }
+    if (expr->getKind() != expr_binary)
+        return 0;
+
+    auto& bin = static_cast<BinaryExprAST&>(*expr);
+    changes += StrengthReduceExpr(bin.getLHSPtr()) + StrengthReduceExpr(bin.getRHSPtr());
+    if (bin.getOp() != '*')
+        return changes;
+
+    const ExprAST *var = nullptr;
+    if (bin.getLHS().getKind() == expr_variable && IsNumber(bin.getRHS(), 2.0))
+        var = &bin.getLHS();
+    else if (bin.getRHS().getKind() == expr_variable && IsNumber(bin.getLHS(), 2.0))
+        var = &bin.getRHS();
+    if (!var)
+        return changes;
+
+    const std::string& name = static_cast<const VariableExprAST *>(var)->getName();
+    expr = std::make_unique<BinaryExprAST>('+', std::make_unique<VariableExprAST>(name),
+                                           std::make_unique<VariableExprAST>(name));
+    return changes + 1;
+}
+
+unsigned StrengthReducePass(FunctionAST& function)
+{
+    return StrengthReduceExpr(function.getBodyPtr());
+}
+
+/// deadargs - Record on the FunctionAST which parameters the body never
+/// reads, for backends that want to drop them. Counts one finding per unused
+/// parameter.
+void CollectVariables(const ExprAST& expr, std::vector<std::string>& names)
+{
+    switch (expr.getKind())
+    {
+    case expr_number:
+        return;
+    case expr_variable:
+        names.push_back(static_cast<const VariableExprAST&>(expr).getName());
+        return;
+    case expr_binary:
+    {
+        auto& bin = static_cast<const BinaryExprAST&>(expr);
+        CollectVariables(bin.getLHS(), names);
+        CollectVariables(bin.getRHS(), names);
+        return;
+    }
+    case expr_call:
+        for (const auto& arg : static_cast<const CallExprAST&>(expr).getArgs())
+            CollectVariables(*arg, names);
+        return;
+    }
+}
+
+unsigned DeadArgumentPass(FunctionAST& function)
+{
+    std::vector<std::string> used;
+    CollectVariables(function.getBody(), used);
+
+    const std::vector<std::string>& params = function.getPrototype().getArgs();
+    std::vector<bool> unused(params.size(), true);
+    unsigned count = 0;
+    for (size_t i = 0; i < params.size(); ++i)
+    {
+        for (const std::string& name : used)
+        {
+            if (name == params[i])
+            {
+                unused[i] = false;
+                break;
+            }
+        }
+        count += unused[i];
+    }
+    function.setUnusedArgs(std::move(unused));
+    return count;
+}
+
+/// ASTPass - One entry of the pass pipeline. run returns how many rewrites
+/// (or findings, for analyses) it made, for the report.
+struct ASTPass
+{
+    const char *name;
+    unsigned (*run)(FunctionAST&);
+    bool enabled;
+    double seconds;
+    unsigned changes;
+};
+
+/// ASTPasses - The pipeline, in the order it runs. Canonicalization comes
+/// first so that the later passes only have to look for constants on the right.
+static std::vector<ASTPass> ASTPasses = {
+    {"canonicalize", CanonicalizePass, true, 0, 0},
+    {"constfold", ConstantFoldPass, true, 0, 0},
+    {"simplify", SimplifyPass, true, 0, 0},
+    {"strength", StrengthReducePass, true, 0, 0},
+    {"deadargs", DeadArgumentPass, true, 0, 0},
+};
+
+/// SetASTPassEnabled - Switch the named pass on or off.
+bool SetASTPassEnabled(const char *name, bool enabled)
+{
+    for (ASTPass& pass : ASTPasses)
+    {
+        if (!strcmp(pass.name, name))
+        {
+            pass.enabled = enabled;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// RunASTPasses - Run every enabled pass over `function`, before any backend
+/// sees it.
+void RunASTPasses(FunctionAST& function)
+{
+    for (ASTPass& pass : ASTPasses)
+    {
+        if (!pass.enabled)
+            continue;
+        auto start = std::chrono::steady_clock::now();
+        pass.changes += pass.run(function);
+        pass.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+/// PrintASTPassReport - Time spent and changes made by each pass so far.
+void PrintASTPassReport(FILE *out)
+{
+    fprintf(out, "===-- AST pass report --===\n");
+    fprintf(out, "  %-14s %12s %10s\n", "pass", "seconds", "changes");
+    for (const ASTPass& pass : ASTPasses)
+    {
+        if (pass.enabled)
+            fprintf(out, "  %-14s %12.6f %10u\n", pass.name, pass.seconds, pass.changes);
+        else
+            fprintf(out, "  %-14s %12s %10s\n", pass.name, "disabled", "-");
+    }
+}
+
+#endif
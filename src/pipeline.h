@@ -0,0 +1,72 @@
+// Pipelined lexing, parsing and compilation
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#include "lexer.h"
+#include "parser.h"
+#include "ring.h"
+
+// MainLoop lexes, parses and compiles one statement strictly after another,
+// so reading a large file leaves the parser idle while the lexer waits on I/O
+// and both idle while a def is optimized and installed. The pipeline runs the
+// three as stages on their own threads, connected by SPSC rings: a lexer
+// thread pushes tokens, a parser thread turns them into TopLevelItems, and
+// the calling thread runs those in order. Only the last stage touches the
+// function table, so statements still take effect in the order written. The
+// parser's syntax errors are reported as it finds them, which may be ahead of
+// the output of the statements before them.
+
+/// PipelinedParsing - Read the main input through RunPipeline.
+static bool PipelinedParsing = false;
+/// ItemRingSize - Parsed statements the parser may run ahead by.
+static const size_t ItemRingSize = 64;
+
+/// RunPipeline - MainLoop over `input`, as three pipeline stages.
+void RunPipeline(FILE *input)
+{
+    auto tokens = std::make_unique<SPSCRing<TokenRecord, TokenRingSize> >();
+    auto items = std::make_unique<SPSCRing<TopLevelItem, ItemRingSize> >();
+
+    std::thread lexer([&] {
+        SetLexerInput(input);
+        int tok;
+        do
+        {
+            tok = gettok();
+            tokens->push({tok, tok == tok_identifier ? IdentifierStr : std::string(), NumVal});
+        } while (tok != tok_eof);
+    });
+
+    std::thread parser([&] {
+        TokenStream = tokens.get();
+        getNextToken();
+        TopLevelKind kind;
+        do
+        {
+            TopLevelItem item;
+            ParseTopLevelItem(item);
+            kind = item.kind;
+            if (kind != top_none)
+                items->push(std::move(item));
+        } while (kind != top_eof);
+        TokenStream = nullptr;
+    });
+
+    while (true)
+    {
+        fprintf(stderr, "ready> ");
+        TopLevelItem item = items->pop();
+        if (item.kind == top_eof)
+            break;
+        RunTopLevelItem(item);
+    }
+    lexer.join();
+    parser.join();
+}
+
+#endif
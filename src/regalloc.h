@@ -0,0 +1,214 @@
+// Linear-scan register allocation
+
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "ir.h"
+
+// Allocates the values of an IRFunction to the x86-64 XMM registers, for
+// backends that emit machine code. The IR is one basic block, so each value is
+// live from its definition to its last use. Every XMM register is caller-saved
+// in the System V ABI, so a value that stays live across a call has to be in
+// memory during the call. Such values have their interval split at each call:
+// the value is stored once and reloaded just before its first use after the
+// call. That avoids holding a register across the whole call span. Constants
+// are rematerialized instead of stored.
+
+/// NumXMMRegisters - Allocatable vector registers on x86-64 without AVX-512.
+static const unsigned NumXMMRegisters = 16;
+/// RegAllocReport - Allocate registers for each lowered function and print the
+/// spill statistics, to see how register pressure grows with formula size.
+static bool RegAllocReport = false;
+
+/// LiveSegment - One piece of a value's live interval. A segment is either
+/// given a register for its whole length or left in memory, in which case each
+/// use within it reads the spill slot.
+struct LiveSegment
+{
+    unsigned value;
+    unsigned start, end;  // twice the instruction position, see AllocateRegisters
+    unsigned uses;        // uses inside this segment
+    bool afterCall;       // starts with a reload (or remat) after a call
+    int reg = -1;         // assigned register, or -1 if spilled
+};
+
+struct RegAllocation
+{
+    std::vector<LiveSegment> segments;
+    unsigned values = 0;
+    unsigned splits = 0;       // extra segments created at calls
+    unsigned spillSlots = 0;   // values that needed a stack slot
+    unsigned stores = 0;       // stores into spill slots
+    unsigned reloads = 0;      // loads from spill slots
+    unsigned remats = 0;       // constants recomputed instead of reloaded
+    unsigned spilledSegments = 0; // segments that got no register at all
+};
+
+/// AllocateRegisters - Linear scan over the split live segments of `function`.
+/// When no register is free, the segment among the active ones and the new one
+/// that ends last is left in memory.
+RegAllocation AllocateRegisters(const IRFunction& function, unsigned numRegs = NumXMMRegisters)
+{
+    const std::vector<IRInst>& insts = function.insts;
+    unsigned n = insts.size();
+    RegAllocation result;
+    result.values = n;
+
+    // Use positions of every value; the return is a use at position n. Segments
+    // are measured in half steps: instruction i is at 2i, and a reload for a use
+    // at u happens at 2u-1, before the operands of u can be freed.
+    std::vector<std::vector<unsigned> > uses(n);
+    for (unsigned i = 0; i < n; ++i)
+        for (unsigned operand : insts[i].operands)
+            uses[operand].push_back(i);
+    uses[function.result].push_back(n);
+    std::vector<unsigned> calls;
+    for (unsigned i = 0; i < n; ++i)
+        if (insts[i].op == ir_call)
+            calls.push_back(i);
+
+    // Split each interval at the calls strictly inside it.
+    std::vector<bool> needsSlot(n, false);
+    for (unsigned v = 0; v < n; ++v)
+    {
+        LiveSegment segment{v, 2 * v, 2 * v, 0, false};
+        auto call = std::upper_bound(calls.begin(), calls.end(), v);
+        for (unsigned use : uses[v])
+        {
+            if (call != calls.end() && *call < use)
+            {
+                // The value is live across at least one call before this use.
+                result.segments.push_back(segment);
+                while (call != calls.end() && *call < use)
+                    ++call;
+                segment = LiveSegment{v, 2 * use - 1, 2 * use, 0, true};
+                ++result.splits;
+                if (insts[v].op == ir_const)
+                    ++result.remats;
+                else
+                {
+                    needsSlot[v] = true;
+                    ++result.reloads;
+                }
+            }
+            segment.end = 2 * use;
+            ++segment.uses;
+        }
+        result.segments.push_back(segment);
+    }
+
+    std::sort(result.segments.begin(), result.segments.end(),
+              [](const LiveSegment& a, const LiveSegment& b) { return a.start < b.start; });
+
+    std::vector<LiveSegment *> active;
+    std::vector<int> freeRegs;
+    for (int r = numRegs - 1; r >= 0; --r)
+        freeRegs.push_back(r);
+
+    for (LiveSegment& segment : result.segments)
+    {
+        // Expire segments that ended before this one starts. A segment ending
+        // at an instruction frees its register for that instruction's result.
+        for (size_t k = 0; k < active.size();)
+        {
+            if (active[k]->end <= segment.start)
+            {
+                freeRegs.push_back(active[k]->reg);
+                active.erase(active.begin() + k);
+            }
+            else
+                ++k;
+        }
+
+        if (!freeRegs.empty())
+        {
+            segment.reg = freeRegs.back();
+            freeRegs.pop_back();
+            active.push_back(&segment);
+            continue;
+        }
+
+        auto furthest = std::max_element(active.begin(), active.end(),
+                                         [](LiveSegment *a, LiveSegment *b) { return a->end < b->end; });
+        if ((*furthest)->end > segment.end)
+        {
+            segment.reg = (*furthest)->reg;
+            (*furthest)->reg = -1;
+            *furthest = &segment;
+        }
+    }
+
+    for (const LiveSegment& segment : result.segments)
+    {
+        if (segment.reg >= 0)
+            continue;
+        ++result.spilledSegments;
+        if (insts[segment.value].op == ir_const)
+            continue; // used as a memory or immediate operand
+        needsSlot[segment.value] = true;
+        // Every use reads memory; a reload already counted for the split no
+        // longer happens separately.
+        result.reloads += segment.uses - (segment.afterCall ? 1 : 0);
+    }
+    for (unsigned v = 0; v < n; ++v)
+    {
+        if (needsSlot[v])
+        {
+            ++result.spillSlots;
+            ++result.stores;
+        }
+    }
+    return result;
+}
+
+/// CheckAllocation - Whether no two segments in `allocation` hold one register
+/// at once. The only overlap allowed is an instruction's result taking the
+/// register of an operand whose last use it is, so this also catches two
+/// operands of one instruction sharing a register.
+bool CheckAllocation(const IRFunction& function, const RegAllocation& allocation)
+{
+    std::vector<std::vector<const LiveSegment *> > byReg;
+    for (const LiveSegment& segment : allocation.segments)
+    {
+        if (segment.reg < 0)
+            continue;
+        if (byReg.size() <= (size_t)segment.reg)
+            byReg.resize(segment.reg + 1);
+        byReg[segment.reg].push_back(&segment);
+    }
+    for (size_t reg = 0; reg < byReg.size(); ++reg)
+    {
+        // Segments are sorted by start already.
+        const LiveSegment *last = nullptr;
+        for (const LiveSegment *segment : byReg[reg])
+        {
+            if (last && (segment->start < last->end || (segment->start == last->end && segment->afterCall)))
+            {
+                fprintf(stderr, "regalloc: %s: values %u and %u share xmm%zu at instruction %u\n",
+                        function.name.empty() ? "<top-level>" : function.name.c_str(), last->value,
+                        segment->value, reg, segment->start / 2);
+                return false;
+            }
+            if (!last || segment->end > last->end)
+                last = segment;
+        }
+    }
+    return true;
+}
+
+/// PrintRegAllocReport - One line of allocation statistics for `function`.
+void PrintRegAllocReport(const IRFunction& function, const RegAllocation& allocation, FILE *out)
+{
+    fprintf(out,
+            "regalloc: %s: %u values, %zu segments (%u splits), %u spill slots, "
+            "%u stores, %u reloads, %u remats, %u spilled segments\n",
+            function.name.empty() ? "<top-level>" : function.name.c_str(), allocation.values,
+            allocation.segments.size(), allocation.splits, allocation.spillSlots, allocation.stores,
+            allocation.reloads, allocation.remats, allocation.spilledSegments);
+}
+
+#endif
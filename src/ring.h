@@ -0,0 +1,96 @@
+// Single-producer single-consumer ring buffer
+
+#ifndef RING_H
+#define RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+/// RingBackoff - How a side of a ring waits for the other: spin briefly, then
+/// yield, then sleep for growing intervals, so that a stage stalled on slow
+/// input (a terminal, say) does not keep a core busy.
+class RingBackoff {
+  private:
+    unsigned rounds = 0;
+
+  public:
+    void pause()
+    {
+        if (rounds >= 128)
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000u, (rounds - 127) * 10)));
+        else if (rounds >= 64)
+            std::this_thread::yield();
+        ++rounds;
+    }
+};
+
+/// SPSCRing - A bounded queue between exactly one producer thread and one
+/// consumer thread. Each side writes only its own index and reads the other's,
+/// so neither takes a lock; each also keeps a private copy of the other's
+/// index and only reloads it when the ring looks full or empty.
+template <typename T, size_t Capacity>
+class SPSCRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "ring capacity must be a power of two");
+
+  private:
+    alignas(64) std::atomic<size_t> head{0}; // Next slot to pop; the consumer's.
+    size_t cachedTail = 0;                   // The consumer's view of tail.
+    alignas(64) std::atomic<size_t> tail{0}; // Next slot to push; the producer's.
+    size_t cachedHead = 0;                   // The producer's view of head.
+    alignas(64) T slots[Capacity];
+
+  public:
+    /// tryPush - Move `value` in, unless the ring is full.
+    bool tryPush(T& value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead == Capacity)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead == Capacity)
+                return false;
+        }
+        slots[t & (Capacity - 1)] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// tryPop - Move the oldest value out into `value`, unless the ring is
+    /// empty.
+    bool tryPop(T& value)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+                return false;
+        }
+        value = std::move(slots[h & (Capacity - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// push, pop - Wait until the ring has room or a value.
+    void push(T value)
+    {
+        RingBackoff backoff;
+        while (!tryPush(value))
+            backoff.pause();
+    }
+
+    T pop()
+    {
+        T value;
+        RingBackoff backoff;
+        while (!tryPop(value))
+            backoff.pause();
+        return value;
+    }
+};
+
+#endif
@@ -0,0 +1,319 @@
+// Evaluation server on a Unix domain socket
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "threadpool.h"
+
+// A long-running process that clients on the same machine send scripts and
+// batches to, so that parsing and compiling a library is paid once rather
+// than per request. Each connection gets its own Session, layered over the
+// shared image when there is one. Requests from all connections are served
+// on a pool of threads; one connection's requests are served in order.
+//
+// Every message is a frame: a 4-byte payload length and a 1-byte kind, then
+// the payload. Numbers are in the host's byte order, since both ends share the
+// machine.
+//
+//   'S' script    request:  the source text
+//                 response: u32 count, then per top-level expression u8 ok
+//                           and f64 value
+//   'B' batch     request:  u32 name length, name, u32 arity, u32 rows, then
+//                           rows * arity f64 arguments, row by row
+//                 response: rows f64 results
+//   'E' error     response: a message, instead of either of the above
+
+/// MaxFrameBytes - Largest payload the server accepts.
+static const uint32_t MaxFrameBytes = 1u << 30;
+/// FrameTimeoutSeconds - How long a request thread waits for the rest of a
+/// frame that has started to arrive before it drops the client, so that a
+/// client that stalls mid-frame cannot hold the thread.
+static const int FrameTimeoutSeconds = 30;
+
+/// ClientConnection - One client and its private definitions. While `busy`,
+/// a request task owns the socket and the poll loop leaves it alone. Once
+/// `released`, its session is gone and the poll loop may delete it.
+struct ClientConnection
+{
+    int fd;
+    Session session;
+    std::atomic<bool> busy{false};
+    std::atomic<bool> closed{false};
+    std::atomic<bool> released{false};
+};
+
+/// ReadFully, WriteFully - Transfer exactly `size` bytes, or fail.
+bool ReadFully(int fd, void *data, size_t size)
+{
+    char *p = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteFully(int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/// ReadFrame, WriteFrame - One message of the protocol.
+bool ReadFrame(int fd, char& kind, std::string& payload)
+{
+    uint32_t size;
+    if (!ReadFully(fd, &size, sizeof(size)) || size > MaxFrameBytes || !ReadFully(fd, &kind, 1))
+        return false;
+    payload.resize(size);
+    return ReadFully(fd, &payload[0], size);
+}
+
+bool WriteFrame(int fd, char kind, const std::string& payload)
+{
+    uint32_t size = payload.size();
+    return WriteFully(fd, &size, sizeof(size)) && WriteFully(fd, &kind, 1) &&
+           WriteFully(fd, payload.data(), payload.size());
+}
+
+/// AppendValue - Append the bytes of `value` to a payload.
+template <typename T>
+void AppendValue(std::string& payload, const T& value)
+{
+    payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+/// TakeValue - Read a `T` from `payload` at `offset` and advance past it.
+template <typename T>
+bool TakeValue(const std::string& payload, size_t& offset, T& value)
+{
+    if (payload.size() - offset < sizeof(value))
+        return false;
+    memcpy(&value, payload.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+/// ServeScript - Run a script request; the response is always 'S'.
+std::string ServeScript(const std::string& text)
+{
+    std::vector<TopLevelResult> results;
+    // fmemopen rejects an empty buffer, and an empty script does nothing.
+    if (FILE *input = text.empty() ? nullptr : fmemopen((void *)text.data(), text.size(), "r"))
+    {
+        results = RunScript(input);
+        fclose(input);
+    }
+    std::string payload;
+    AppendValue(payload, (uint32_t)results.size());
+    for (const TopLevelResult& result : results)
+    {
+        AppendValue(payload, (uint8_t)result.ok);
+        AppendValue(payload, result.value);
+    }
+    return payload;
+}
+
+/// ServeBatch - Run a batch request, setting `kind` to 'B' or 'E'.
+std::string ServeBatch(const std::string& request, char& kind, ThreadPool& pool)
+{
+    kind = 'E';
+    size_t offset = 0;
+    uint32_t nameSize, arity, numRows;
+    if (!TakeValue(request, offset, nameSize) || request.size() - offset < nameSize)
+        return "Malformed batch request";
+    std::string name = request.substr(offset, nameSize);
+    offset += nameSize;
+    if (!TakeValue(request, offset, arity) || !TakeValue(request, offset, numRows) ||
+        (request.size() - offset) / sizeof(double) / std::max<uint32_t>(arity, 1) < numRows)
+        return "Malformed batch request";
+
+    std::vector<double> rows((size_t)arity * numRows);
+    memcpy(rows.data(), request.data() + offset, rows.size() * sizeof(double));
+    std::vector<double> results;
+    if (!EvaluateBatch(name, rows, numRows, results, pool))
+        return "Cannot evaluate '" + name + "' over the batch";
+    kind = 'B';
+    return std::string(reinterpret_cast<const char *>(results.data()), results.size() * sizeof(double));
+}
+
+/// ServeRequest - Read one request from `connection` and answer it, in the
+/// connection's session. Runs on a request thread.
+void ServeRequest(ClientConnection& connection, ThreadPool& evaluationPool)
+{
+    char kind;
+    std::string request;
+    if (!ReadFrame(connection.fd, kind, request))
+    {
+        connection.closed = true;
+        return;
+    }
+
+    CurrentSession = &connection.session;
+    std::string response;
+    if (kind == 'S')
+        response = ServeScript(request);
+    else if (kind == 'B')
+        response = ServeBatch(request, kind, evaluationPool);
+    else
+    {
+        response = std::string("Unknown request kind '") + kind + "'";
+        kind = 'E';
+    }
+    CurrentSession = nullptr;
+
+    if (!WriteFrame(connection.fd, kind, response))
+        connection.closed = true;
+}
+
+/// RunServer - Listen on the Unix domain socket at `path` and serve clients
+/// until the process is killed. Requests run on `requestThreads` threads, and
+/// their evaluation forks and batches on `evaluationPool`.
+int RunServer(const char *path, unsigned requestThreads, ThreadPool& evaluationPool)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return LogErrorR(std::string("Socket path '") + path + "' is too long"), 1;
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+        return LogErrorR(std::string("Cannot listen on '") + path + "'"), 1;
+
+    // Request tasks write a byte here when they finish, so that the poll loop
+    // takes their connection back. Non-blocking at both ends: the loop drains
+    // it until it is empty, and a task never waits on a full pipe, which
+    // already holds a wakeup.
+    int wake[2];
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) != 0)
+        return LogErrorR("Cannot create a pipe"), 1;
+
+    // A separate pool, so that a request waiting on evaluation tasks never
+    // picks up another request and runs it in the wrong session.
+    ThreadPool requestPool(requestThreads);
+    TaskGroup inFlight;
+    std::vector<std::unique_ptr<ClientConnection> > connections;
+    fprintf(stderr, "Serving on %s\n", path);
+
+    while (true)
+    {
+        std::vector<pollfd> polled = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        std::vector<ClientConnection *> idle;
+        for (auto& connection : connections)
+        {
+            if (!connection->busy)
+            {
+                polled.push_back({connection->fd, POLLIN, 0});
+                idle.push_back(connection.get());
+            }
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return LogErrorR("poll failed"), 1;
+        }
+
+        if (polled[1].revents)
+        {
+            char drain[64];
+            ssize_t n;
+            while ((n = read(wake[0], drain, sizeof(drain))) > 0 || (n < 0 && errno == EINTR))
+                ;
+        }
+        if (polled[0].revents & POLLIN)
+        {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                timeval timeout = {FrameTimeoutSeconds, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                connections.push_back(std::make_unique<ClientConnection>());
+                connections.back()->fd = fd;
+            }
+        }
+        auto wakeUp = [&wake] {
+            char byte = 0;
+            ssize_t ignored = write(wake[1], &byte, 1);
+            (void)ignored;
+        };
+        for (size_t i = 0; i < idle.size(); ++i)
+        {
+            if (!polled[i + 2].revents)
+                continue;
+            ClientConnection *connection = idle[i];
+            connection->busy = true;
+            requestPool.spawn(inFlight, [connection, &evaluationPool, wakeUp] {
+                ServeRequest(*connection, evaluationPool);
+                connection->busy = false;
+                wakeUp();
+            });
+        }
+
+        // A session is only released once no request is using it, so its code
+        // cannot be running any more, and once the compile thread has
+        // installed what it queued, since the queue refers to it. That may
+        // wait on a build, so it happens on the request pool.
+        for (size_t i = 0; i < connections.size();)
+        {
+            ClientConnection *connection = connections[i].get();
+            if (connection->released)
+            {
+                close(connection->fd);
+                connections.erase(connections.begin() + i);
+                continue;
+            }
+            if (connection->closed && !connection->busy)
+            {
+                connection->busy = true; // for good
+                requestPool.spawn(inFlight, [connection, wakeUp] {
+                    AwaitDefinitions(&connection->session);
+                    ReleaseSession(connection->session);
+                    connection->released = true;
+                    wakeUp();
+                });
+            }
+            ++i;
+        }
+    }
+}
+
+#endif
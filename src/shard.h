@@ -0,0 +1,280 @@
+// Batch evaluation sharded across worker processes
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cbackend.h"
+#include "interpreter.h"
+#include "server.h"
+#include "threadpool.h"
+
+// A batch too large for one process, or one whose function might crash, is
+// split across worker processes. The coordinator compiles everything first
+// and then forks the workers, so each one starts with the compiled table in
+// its address space instead of building it again. It then reads the rows a
+// range at a time, hands each range to an idle worker over a socketpair (in
+// the frames of server.h) and prints the results in row order as they come
+// back. Only the ranges in flight and the results still waiting on an earlier
+// range are held in memory. A worker that dies or sends garbage is replaced,
+// and the ranges it held are handed out again.
+
+/// ShardRows - Rows handed to a worker at a time.
+static size_t ShardRows = 4096;
+/// MaxShardAttempts - Workers a range may take down before the batch fails.
+static const unsigned MaxShardAttempts = 3;
+
+/// ShardRange - A run of consecutive rows, numbered from the start of input.
+struct ShardRange
+{
+    uint64_t first;
+    size_t numRows;
+    std::vector<double> rows;
+    unsigned attempts;
+};
+
+/// ShardWorker - A worker process and the range it is evaluating, if any.
+/// There is at most one, so that the worker never blocks sending results
+/// while the coordinator blocks sending it rows.
+struct ShardWorker
+{
+    pid_t pid = -1;
+    int fd = -1;
+    std::unique_ptr<ShardRange> range;
+};
+
+/// RunShardWorker - The body of a worker process: evaluate `name` over every
+/// range that arrives on `fd` until the coordinator closes it. A range is a
+/// 'B' frame of a u64 row count and the rows, `arity` arguments each; the
+/// reply is a 'B' frame of the results. Anything else ends the worker.
+int RunShardWorker(int fd, const std::string& name, size_t arity, unsigned threads)
+{
+    // The coordinator's pool threads do not exist in this process.
+    ThreadPool pool(threads);
+    EvaluationPool = &pool;
+
+    char kind;
+    std::string request;
+    while (ReadFrame(fd, kind, request))
+    {
+        size_t offset = 0;
+        uint64_t numRows;
+        if (kind != 'B' || !TakeValue(request, offset, numRows) ||
+            request.size() - offset != numRows * arity * sizeof(double))
+            return 1;
+        std::vector<double> rows(numRows * arity);
+        memcpy(rows.data(), request.data() + offset, rows.size() * sizeof(double));
+        std::vector<double> results;
+        if (!EvaluateBatch(name, rows, numRows, results, pool))
+            return 1;
+        std::string response(reinterpret_cast<const char *>(results.data()), results.size() * sizeof(double));
+        if (!WriteFrame(fd, 'B', response))
+            return 1;
+    }
+    return 0;
+}
+
+/// StartShardWorker - Fork a worker for `workers[index]`.
+bool StartShardWorker(std::vector<ShardWorker>& workers, size_t index, const std::string& name, size_t arity,
+                      unsigned threads)
+{
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) != 0)
+        return LogErrorR("Cannot create a socketpair for a batch worker");
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(ends[0]);
+        close(ends[1]);
+        return LogErrorR("Cannot fork a batch worker");
+    }
+    if (pid == 0)
+    {
+        close(ends[0]);
+        for (const ShardWorker& other : workers)
+            if (other.fd >= 0)
+                close(other.fd);
+        // _exit: the inherited pool's destructor would join threads that were
+        // not forked.
+        _exit(RunShardWorker(ends[1], name, arity, threads));
+    }
+    close(ends[1]);
+    workers[index].pid = pid;
+    workers[index].fd = ends[0];
+    return true;
+}
+
+/// StopShardWorker - Reap `worker`, killing it first unless it is known to
+/// have exited.
+void StopShardWorker(ShardWorker& worker, bool kill)
+{
+    if (worker.pid < 0)
+        return;
+    if (kill)
+        ::kill(worker.pid, SIGKILL);
+    close(worker.fd);
+    waitpid(worker.pid, nullptr, 0);
+    worker.pid = -1;
+    worker.fd = -1;
+}
+
+/// EvaluateShardedBatch - Evaluate `name` once per row of `input` on
+/// `numWorkers` worker processes of `threads` threads each, and print the
+/// results to `output` in row order.
+bool EvaluateShardedBatch(const std::string& name, FILE *input, unsigned numWorkers, unsigned threads,
+                          FILE *output)
+{
+    size_t arity;
+    {
+        std::lock_guard<std::recursive_mutex> lock(TableMutex);
+        const FunctionSlot *slot = ReferenceFunction(name);
+        if (!slot || slot->isExtern)
+            return LogErrorR("Unknown function referenced '" + name + "'");
+        arity = slot->arity;
+        // Build what the batch runs before forking, so that the workers start
+        // with it: just what `name` can reach, not the rest of the table.
+        PrepareForEvaluation();
+        std::vector<unsigned> pending;
+        for (unsigned index : CallClosure({slot->index}))
+            if (FunctionSlots[index]->definition && !FunctionSlots[index]->ready)
+                pending.push_back(index);
+        CompileFunctions(pending);
+    }
+
+    std::vector<ShardWorker> workers(std::max(1u, numWorkers));
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        if (!StartShardWorker(workers, i, name, arity, threads))
+        {
+            for (ShardWorker& worker : workers)
+                StopShardWorker(worker, true);
+            return false;
+        }
+    }
+
+    std::vector<std::unique_ptr<ShardRange> > retry; // Ranges a failed worker held.
+    std::map<uint64_t, std::vector<double> > finished; // Results out of order.
+    uint64_t nextRow = 0, nextPrinted = 0;
+    size_t lineNo = 0;
+    bool inputDone = false, ok = true;
+
+    while (ok)
+    {
+        // Hand a range to every idle worker.
+        for (size_t i = 0; i < workers.size() && ok; ++i)
+        {
+            ShardWorker& worker = workers[i];
+            if (worker.range)
+                continue;
+            if (!retry.empty())
+            {
+                worker.range = std::move(retry.back());
+                retry.pop_back();
+            }
+            else if (!inputDone)
+            {
+                auto range = std::make_unique<ShardRange>();
+                ok = ReadBatchRows(input, arity, range->rows, range->numRows, ShardRows, lineNo);
+                range->first = nextRow;
+                range->attempts = 0;
+                nextRow += range->numRows;
+                inputDone = range->numRows < ShardRows;
+                if (range->numRows > 0)
+                    worker.range = std::move(range);
+            }
+            if (!worker.range)
+                continue;
+            std::string payload;
+            AppendValue(payload, (uint64_t)worker.range->numRows);
+            payload.append(reinterpret_cast<const char *>(worker.range->rows.data()),
+                           worker.range->rows.size() * sizeof(double));
+            if (!WriteFrame(worker.fd, 'B', payload))
+                shutdown(worker.fd, SHUT_RDWR); // Picked up as a failure below.
+        }
+
+        std::vector<pollfd> polled;
+        std::vector<size_t> busy;
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            if (workers[i].range)
+            {
+                polled.push_back({workers[i].fd, POLLIN, 0});
+                busy.push_back(i);
+            }
+        }
+        if (!ok || polled.empty())
+            break;
+        if (poll(polled.data(), polled.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ok = LogErrorR("poll failed");
+            break;
+        }
+
+        for (size_t k = 0; k < busy.size() && ok; ++k)
+        {
+            if (!polled[k].revents)
+                continue;
+            size_t i = busy[k];
+            ShardWorker& worker = workers[i];
+            char kind;
+            std::string response;
+            if (ReadFrame(worker.fd, kind, response) && kind == 'B' &&
+                response.size() == worker.range->numRows * sizeof(double))
+            {
+                std::vector<double>& results = finished[worker.range->first];
+                results.resize(worker.range->numRows);
+                memcpy(results.data(), response.data(), response.size());
+                worker.range.reset();
+                continue;
+            }
+
+            // The worker died or broke the protocol: replace it and retry its
+            // range, unless that range keeps taking workers down with it.
+            StopShardWorker(worker, true);
+            std::unique_ptr<ShardRange> range = std::move(worker.range);
+            if (++range->attempts >= MaxShardAttempts)
+            {
+                ok = LogErrorR("Batch rows " + std::to_string(range->first + 1) + " to " +
+                               std::to_string(range->first + range->numRows) + " failed in " +
+                               std::to_string(MaxShardAttempts) + " workers");
+                break;
+            }
+            fprintf(stderr, "Batch worker failed on rows %llu to %llu; restarting it\n",
+                    (unsigned long long)range->first + 1, (unsigned long long)(range->first + range->numRows));
+            retry.push_back(std::move(range));
+            ok = StartShardWorker(workers, i, name, arity, threads);
+        }
+
+        // Print whatever is now contiguous with what has been printed.
+        for (auto it = finished.begin(); it != finished.end() && it->first == nextPrinted; it = finished.erase(it))
+        {
+            for (double result : it->second)
+                fprintf(output, "%.17g\n", result);
+            nextPrinted += it->second.size();
+        }
+    }
+
+    for (ShardWorker& worker : workers)
+        StopShardWorker(worker, !ok);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,234 @@
+// Shared-memory coordination of the code cache
+
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "codecache.h"
+
+// Processes that share a code cache directory also share its modules' machine
+// code: each one maps the cached shared object, and the page cache holds it
+// once. What they cannot see through the directory is a module that another
+// process is still compiling, so without help they all compile it at once.
+// The shared cache is a small table in POSIX shared memory that records, for
+// each module, which process is building it. The first process to ask claims
+// the module with a compare-and-swap and builds it; the others wait for the
+// file to appear. No locks are taken, and a claim left behind by a process
+// that died is taken over by the next one to notice. An entry is only needed
+// until the file is published: the builder then gives it back, and an entry
+// nobody gave back is reused once it is older than any build may take, so the
+// table never fills up for good however many modules pass through it.
+
+/// SharedCacheEntry - One module: a 64-bit tag from its cache key (0 while the
+/// entry is unused, SharedCacheFree once given back), the pid of the process
+/// building it (0 if none), and when it was added or last claimed.
+struct SharedCacheEntry
+{
+    std::atomic<uint64_t> tag;
+    std::atomic<uint64_t> builder;
+    std::atomic<uint64_t> stamp; // SharedCacheNow
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared cache needs address-free atomics");
+
+/// SharedCacheRegion - Layout of the shared memory object.
+struct SharedCacheRegion
+{
+    std::atomic<uint64_t> layout; // SharedCacheLayout once initialized
+    SharedCacheEntry entries[1];  // SharedCacheEntries of them
+};
+
+/// SharedCacheLayout - Identifies this layout, so that a region created by an
+/// incompatible build is left alone.
+static const uint64_t SharedCacheLayout = 0x6b616c6569646f02ull;
+/// SharedCacheFree - Tag of an entry that was given back. Unlike an unused
+/// one, it does not end a probe sequence.
+static const uint64_t SharedCacheFree = ~0ull;
+/// SharedCacheEntries - Modules the region can track. When it is full,
+/// processes compile without coordinating, as they would without it.
+static const size_t SharedCacheEntries = 4096;
+/// SharedCacheWaitLimit - Longest a process waits on another one's build
+/// before building the module itself, in case the pid was reused.
+static const std::chrono::seconds SharedCacheWaitLimit(120);
+/// SharedCacheEntryLifetime - Age at which an entry is reused for another
+/// module even though it was never given back. Past the wait limit, nobody
+/// waits on it anyway.
+static const uint64_t SharedCacheEntryLifetime = 2 * SharedCacheWaitLimit.count();
+
+/// SharedCache - The mapped region, or null when none was requested.
+static SharedCacheRegion *SharedCache = nullptr;
+
+/// OpenSharedCache - Map the shared memory object `name` (e.g. "/kaleidoscope"),
+/// creating it if this is the first process to use it.
+bool OpenSharedCache(const char *name)
+{
+    size_t size = sizeof(SharedCacheRegion) + (SharedCacheEntries - 1) * sizeof(SharedCacheEntry);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return LogErrorR(std::string("Cannot open shared memory '") + name + "'");
+    // A fresh object is zero-filled, which is a valid empty table, so
+    // processes racing to create it need no further handshake.
+    bool ok = ftruncate(fd, size) == 0;
+    void *region = ok ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (region == MAP_FAILED)
+        return LogErrorR(std::string("Cannot map shared memory '") + name + "'");
+
+    auto *cache = static_cast<SharedCacheRegion *>(region);
+    uint64_t layout = 0;
+    if (!cache->layout.compare_exchange_strong(layout, SharedCacheLayout) && layout != SharedCacheLayout)
+    {
+        munmap(region, size);
+        return LogErrorR(std::string("Shared memory '") + name + "' belongs to an incompatible build");
+    }
+    SharedCache = cache;
+    return true;
+}
+
+/// SharedCacheNow - Seconds on a clock that every process on the host shares.
+uint64_t SharedCacheNow()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/// SharedCacheTag - The tag of the module with cache key `key`.
+uint64_t SharedCacheTag(const StructuralHash& key)
+{
+    return key.lo == 0 || key.lo == SharedCacheFree ? 1 : key.lo;
+}
+
+/// FindSharedEntry - The entry for `tag`, added if it is not there yet, or
+/// null if the table is full. A new entry goes in the first one along the
+/// probe sequence that is unused, given back or stale.
+SharedCacheEntry *FindSharedEntry(uint64_t tag)
+{
+    while (true)
+    {
+        uint64_t now = SharedCacheNow();
+        SharedCacheEntry *reusable = nullptr;
+        uint64_t reusableTag = 0;
+        for (size_t probe = 0; probe < SharedCacheEntries; ++probe)
+        {
+            SharedCacheEntry& entry = SharedCache->entries[(tag + probe) % SharedCacheEntries];
+            uint64_t found = entry.tag.load(std::memory_order_acquire);
+            if (found == tag)
+                return &entry;
+            bool stale = found == SharedCacheFree ||
+                         (found != 0 && now - entry.stamp.load(std::memory_order_acquire) > SharedCacheEntryLifetime);
+            if (!reusable && (found == 0 || stale))
+            {
+                reusable = &entry;
+                reusableTag = found;
+            }
+            if (found == 0)
+                break; // the end of the probe sequence
+        }
+        if (!reusable)
+            return nullptr;
+
+        // Refresh the stamp first, so nobody else takes the entry for stale
+        // once it is ours.
+        uint64_t builder = reusable->builder.load(std::memory_order_acquire);
+        reusable->stamp.store(now, std::memory_order_release);
+        if (reusable->tag.compare_exchange_strong(reusableTag, tag, std::memory_order_acq_rel))
+        {
+            reusable->builder.compare_exchange_strong(builder, 0, std::memory_order_acq_rel);
+            return reusable;
+        }
+        // Another process changed the entry meanwhile; look again.
+    }
+}
+
+/// ProcessAlive - Whether a process with this pid still exists.
+bool ProcessAlive(uint64_t pid)
+{
+    return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+}
+
+/// ReleaseModule - Give up the claim AwaitModule handed out, once the module
+/// is in the cache or building it failed.
+void ReleaseModule(SharedCacheEntry *claim)
+{
+    if (!claim)
+        return;
+    uint64_t self = (uint64_t)getpid();
+    if (claim->builder.load(std::memory_order_acquire) != self)
+        return; // taken over meanwhile
+    // Waiters find the file, or the entry gone and look the module up again.
+    uint64_t tag = claim->tag.load(std::memory_order_acquire);
+    claim->tag.compare_exchange_strong(tag, SharedCacheFree, std::memory_order_acq_rel);
+    claim->builder.compare_exchange_strong(self, 0, std::memory_order_acq_rel);
+}
+
+/// AwaitModule - Wait until the cached module at `library`, whose cache key
+/// is `key`, exists or this process has the claim on building it. Returns
+/// true once the file exists. Otherwise the caller builds the module and
+/// passes `claim` (null when nothing is coordinated) to ReleaseModule.
+bool AwaitModule(const StructuralHash& key, const std::string& library, SharedCacheEntry *&claim)
+{
+    claim = nullptr;
+    // Checked first, so that a module already built takes no entry.
+    if (FileExists(library))
+        return true;
+    if (!SharedCache)
+        return false;
+    uint64_t tag = SharedCacheTag(key);
+    SharedCacheEntry *entry = FindSharedEntry(tag);
+    if (!entry)
+        return FileExists(library);
+
+    uint64_t self = (uint64_t)getpid();
+    auto deadline = std::chrono::steady_clock::now() + SharedCacheWaitLimit;
+    auto pause = std::chrono::microseconds(100);
+    while (true)
+    {
+        if (FileExists(library))
+            return true;
+        if (entry->tag.load(std::memory_order_acquire) != tag)
+        {
+            // Given back after a failed build, or reused as stale.
+            entry = FindSharedEntry(tag);
+            if (!entry)
+                return FileExists(library);
+            continue;
+        }
+        uint64_t builder = entry->builder.load(std::memory_order_acquire);
+        // Nobody is building it, or the builder died or is taking too long:
+        // take the claim over, unless another process got there first.
+        if (builder == 0 || builder == self || !ProcessAlive(builder) ||
+            std::chrono::steady_clock::now() > deadline)
+        {
+            if (!entry->builder.compare_exchange_strong(builder, self, std::memory_order_acq_rel))
+                continue;
+            entry->stamp.store(SharedCacheNow(), std::memory_order_release);
+            if (entry->tag.load(std::memory_order_acquire) != tag)
+            {
+                // Reused for another module just before the claim.
+                entry->builder.compare_exchange_strong(self, 0, std::memory_order_acq_rel);
+                continue;
+            }
+            claim = entry;
+            if (!FileExists(library)) // it may have landed meanwhile
+                return false;
+            ReleaseModule(claim);
+            claim = nullptr;
+            return true;
+        }
+        std::this_thread::sleep_for(pause);
+        pause = std::min(pause * 2, std::chrono::microseconds(20000));
+    }
+}
+
+#endif
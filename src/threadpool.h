@@ -0,0 +1,211 @@
+// Work-stealing thread pool
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// TaskGroup - Counts the outstanding tasks spawned into it, so that
+/// ThreadPool::wait can tell when all of them have finished.
+class TaskGroup {
+  private:
+    std::atomic<size_t> pending{0};
+
+    friend class ThreadPool;
+
+  public:
+    bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+};
+
+/// ThreadPool - A fixed set of workers, each owning a deque of tasks. A worker
+/// pops from the back of its own deque and, once that is empty, steals from the
+/// front of somebody else's. Threads that wait on a TaskGroup keep running
+/// tasks instead of blocking, so the caller of wait() counts as a worker too.
+class ThreadPool {
+  private:
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue> > queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<size_t> queued{0};
+    std::atomic<unsigned> nextQueue{0};
+    bool stopping = false;
+
+    /// Identifies the pool and queue the calling thread works for, if any.
+    struct WorkerIdentity {
+        const ThreadPool* pool = nullptr;
+        unsigned index = 0;
+        unsigned seed = 0x9e3779b9u;
+    };
+    static WorkerIdentity& CurrentWorker()
+    {
+        static thread_local WorkerIdentity identity;
+        return identity;
+    }
+
+    int ownQueue() const
+    {
+        const WorkerIdentity& self = CurrentWorker();
+        return self.pool == this ? (int)self.index : -1;
+    }
+
+    void push(unsigned index, Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wakeup.notify_one();
+    }
+
+    bool tryPop(unsigned index, Task& task)
+    {
+        WorkerQueue& queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool trySteal(int self, Task& task)
+    {
+        // Start at a pseudo-random victim so thieves spread out.
+        unsigned& seed = CurrentWorker().seed;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        unsigned n = queues.size();
+        for (unsigned k = 0; k < n; ++k)
+        {
+            unsigned victim = (seed + k) % n;
+            if ((int)victim == self)
+                continue;
+            WorkerQueue& queue = *queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    bool tryRunOne()
+    {
+        int self = ownQueue();
+        Task task;
+        if ((self >= 0 && tryPop(self, task)) || trySteal(self, task))
+        {
+            task.fn();
+            task.group->pending.fetch_sub(1, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned index)
+    {
+        WorkerIdentity& self = CurrentWorker();
+        self.pool = this;
+        self.index = index;
+        self.seed += index * 0x85ebca6bu;
+
+        while (true)
+        {
+            if (tryRunOne())
+                continue;
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wakeup.wait(lock, [this] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            if (stopping && queued.load(std::memory_order_acquire) == 0)
+                return;
+        }
+    }
+
+  public:
+    explicit ThreadPool(unsigned numThreads)
+    {
+        if (numThreads == 0)
+            numThreads = 1;
+        for (unsigned i = 0; i < numThreads; ++i)
+            queues.push_back(std::make_unique<WorkerQueue>());
+        for (unsigned i = 0; i < numThreads; ++i)
+            workers.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    unsigned size() const { return workers.size(); }
+
+    /// spawn - Queue `fn` as part of `group`. Tasks spawned from a worker go to
+    /// that worker's own deque; others are dealt out round-robin.
+    void spawn(TaskGroup& group, std::function<void()> fn)
+    {
+        int self = ownQueue();
+        unsigned index = self >= 0 ? (unsigned)self : nextQueue.fetch_add(1) % queues.size();
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        push(index, Task{std::move(fn), &group});
+    }
+
+    /// wait - Run queued tasks on the calling thread until `group` is done.
+    void wait(TaskGroup& group)
+    {
+        while (!group.done())
+        {
+            if (!tryRunOne())
+                std::this_thread::yield();
+        }
+    }
+
+    /// parallelFor - Run body(i) for every i in [0, count). Consecutive indices
+    /// are dealt to the same worker in contiguous blocks, which keeps neighbouring
+    /// chunks on one core until somebody runs dry and steals.
+    void parallelFor(size_t count, const std::function<void(size_t)>& body)
+    {
+        TaskGroup group;
+        unsigned n = queues.size();
+        for (size_t i = 0; i < count; ++i)
+        {
+            group.pending.fetch_add(1, std::memory_order_relaxed);
+            push((unsigned)(i * n / count), Task{[&body, i] { body(i); }, &group});
+        }
+        wait(group);
+    }
+};
+
+#endif
@@ -0,0 +1,315 @@
+// Vectorized math intrinsics
+
+#ifndef VECMATH_H
+#define VECMATH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "ffi.h"
+
+// Batch evaluation applies an intrinsic to a whole column of rows at once.
+// exp, log, sin and cos are computed VectorLanes rows at a time with GCC
+// vector extensions, which the compiler maps onto SSE2 or AVX registers. The
+// algorithms are those of fdlibm (the basis of most libms): range reduction
+// followed by a minimax polynomial, written without branches so every lane
+// takes the same path. Lanes that need a path the vector code does not have,
+// such as sin of a huge argument, are redone with the scalar libm call. The
+// results are within 1.5 ulp of exact but not always identical to libm;
+// PrintVectorMathReport measures the difference.
+
+/// VectorLanes - Doubles per vector operation.
+static const size_t VectorLanes = 4;
+
+typedef double VecDouble __attribute__((vector_size(VectorLanes * sizeof(double))));
+typedef int64_t VecInt __attribute__((vector_size(VectorLanes * sizeof(double))));
+
+// Vectors are only ever passed by reference or through memory: without AVX,
+// GCC passes a 32-byte vector by value differently than with it, and warns.
+
+/// RoundShifter - Adding and subtracting this rounds |x| < 2^51 to an integer.
+static const double RoundShifter = 0x1.8p52;
+
+/// ExpLanes - e^x for VectorLanes values, as fdlibm's __ieee754_exp.
+void ExpLanes(const double *in, double *out)
+{
+    const double ln2hi = 6.93147180369123816490e-01, ln2lo = 1.90821492927058770002e-10;
+    const double P1 = 1.66666666666666019037e-01, P2 = -2.77777777770155933842e-03,
+                 P3 = 6.61375632143793436117e-05, P4 = -1.65339022054652515390e-06,
+                 P5 = 4.13813679705723846039e-08;
+    const double overflow = 7.09782712893383973096e+02, underflow = -7.45133219101941108420e+02;
+
+    VecDouble x;
+    memcpy(&x, in, sizeof(x));
+
+    // x = k*ln2 + r with |r| <= ln2/2, r carried as hi - lo.
+    VecDouble clamped = x > 710.0 ? 710.0 : (x < -746.0 ? -746.0 : x);
+    clamped = x == x ? clamped : 0.0;
+    VecDouble k = (clamped * 1.44269504088896338700e+00 + RoundShifter) - RoundShifter;
+    VecDouble hi = clamped - k * ln2hi;
+    VecDouble lo = k * ln2lo;
+    VecDouble r = hi - lo;
+
+    VecDouble t = r * r;
+    VecDouble c = r - t * (P1 + t * (P2 + t * (P3 + t * (P4 + t * P5))));
+    VecDouble y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+
+    // Scale by 2^k in two steps so that results in the subnormal range are
+    // rounded once, at the end.
+    VecInt ki = __builtin_convertvector(k, VecInt);
+    VecInt k1 = ki >> 1;
+    VecInt k2 = ki - k1;
+    y = y * (VecDouble)((k1 + 1023) << 52);
+    y = y * (VecDouble)((k2 + 1023) << 52);
+
+    y = x > overflow ? HUGE_VAL : y;
+    y = x < underflow ? 0.0 : y;
+    y = x == x ? y : x;
+    memcpy(out, &y, sizeof(y));
+}
+
+/// LogLanes - Natural logarithm of VectorLanes values, as fdlibm's
+/// __ieee754_log.
+void LogLanes(const double *in, double *out)
+{
+    const double ln2hi = 6.93147180369123816490e-01, ln2lo = 1.90821492927058770002e-10;
+    const double Lg1 = 6.666666666666735130e-01, Lg2 = 3.999999999940941908e-01,
+                 Lg3 = 2.857142874366239149e-01, Lg4 = 2.222219843214978396e-01,
+                 Lg5 = 1.818357216161805012e-01, Lg6 = 1.531383769920937332e-01,
+                 Lg7 = 1.479819860511658591e-01;
+
+    VecDouble x;
+    memcpy(&x, in, sizeof(x));
+
+    // Bring subnormals into the normal range, then split x = m * 2^k with m
+    // in [sqrt(2)/2, sqrt(2)).
+    VecInt subnormal = x < 0x1p-1022;
+    VecDouble scaled = subnormal ? x * 0x1p54 : x;
+    VecInt bits = (VecInt)scaled;
+    VecInt k = ((bits >> 52) & 0x7ff) - 1023 - (subnormal & 54);
+    VecDouble m = (VecDouble)((bits & 0x000fffffffffffffll) | 0x3ff0000000000000ll);
+    VecInt large = m > 1.41421356237309504880;
+    m = large ? m * 0.5 : m;
+    k -= large; // true lanes are -1
+
+    VecDouble f = m - 1.0;
+    VecDouble dk = __builtin_convertvector(k, VecDouble);
+    VecDouble s = f / (2.0 + f);
+    VecDouble z = s * s;
+    VecDouble w = z * z;
+    VecDouble t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+    VecDouble t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+    VecDouble R = t2 + t1;
+    VecDouble hfsq = 0.5 * f * f;
+    VecDouble y = dk * ln2hi - ((hfsq - (s * (hfsq + R) + dk * ln2lo)) - f);
+
+    y = x == HUGE_VAL ? HUGE_VAL : y;
+    y = x == 0.0 ? -HUGE_VAL : y;
+    y = x < 0.0 ? NAN : y;
+    y = x == x ? y : x;
+    memcpy(out, &y, sizeof(y));
+}
+
+/// TrigVectorLimit - Largest |x| whose reduction by pi/2 the vector code does
+/// exactly; sin and cos of anything larger go to libm.
+static const double TrigVectorLimit = 823549.0;
+
+/// SinCosLanes - sin or, with `cosine`, cos of VectorLanes values. The
+/// argument is reduced to x - n*pi/2 = y0 + y1, with pi/2 in four pieces as in
+/// fdlibm's __ieee754_rem_pio2, and then goes through fdlibm's __kernel_sin
+/// and __kernel_cos. Lanes outside TrigVectorLimit come back wrong and must be
+/// patched by the caller.
+void SinCosLanes(const double *in, double *out, bool cosine)
+{
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_2 = 6.07710050630396597660e-11, pio2_2t = 2.02226624879595063154e-21;
+    const double pio2_3 = 2.02226624871116645580e-21, pio2_3t = 8.47842766036889956997e-32;
+    const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03,
+                 S3 = -1.98412698298579493134e-04, S4 = 2.75573137070700676789e-06,
+                 S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+    const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03,
+                 C3 = 2.48015872894767294178e-05, C4 = -2.75573143513906633035e-07,
+                 C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+
+    VecDouble x;
+    memcpy(&x, in, sizeof(x));
+    VecInt inside = x < TrigVectorLimit && x > -TrigVectorLimit;
+    x = inside ? x : 0.0;
+
+    VecDouble n = (x * 6.36619772367581382433e-01 + RoundShifter) - RoundShifter;
+    VecDouble r = x - n * pio2_1;
+    VecDouble t = r;
+    VecDouble w = n * pio2_2;
+    r = t - w;
+    w = n * pio2_2t - ((t - r) - w);
+    t = r;
+    w = n * pio2_3;
+    r = t - w;
+    w = n * pio2_3t - ((t - r) - w);
+    VecDouble y0 = r - w;
+    VecDouble y1 = (r - y0) - w;
+
+    VecDouble z = y0 * y0;
+    VecDouble v = z * y0;
+    VecDouble sr = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+    VecDouble sineValue = y0 - ((z * (0.5 * y1 - v * sr) - y1) - v * S1);
+    VecDouble cr = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+    VecDouble hz = 0.5 * z;
+    VecDouble cw = 1.0 - hz;
+    VecDouble cosineValue = cw + (((1.0 - cw) - hz) + (z * cr - y0 * y1));
+
+    VecInt quadrant = (__builtin_convertvector(n, VecInt) + (cosine ? 1 : 0)) & 3;
+    VecDouble y = (quadrant & 1) ? cosineValue : sineValue;
+    y = (quadrant & 2) ? -y : y;
+    memcpy(out, &y, sizeof(y));
+}
+
+/// ApplyLanes - Run `lanes` over `in`, VectorLanes values at a time; a short
+/// tail goes through a padded buffer. `fixup` says which inputs the vector
+/// code cannot handle, and `scalar` computes those instead.
+template <typename Lanes, typename Fixup>
+void ApplyLanes(const double *in, double *out, size_t count, Lanes lanes, Fixup fixup, double (*scalar)(double))
+{
+    for (size_t i = 0; i < count; i += VectorLanes)
+    {
+        size_t n = count - i < VectorLanes ? count - i : VectorLanes;
+        double x[VectorLanes] = {1.0, 1.0, 1.0, 1.0};
+        double y[VectorLanes];
+        std::copy(in + i, in + i + n, x);
+        lanes(x, y);
+        for (size_t k = 0; k < n; ++k)
+            out[i + k] = fixup(x[k]) ? scalar(x[k]) : y[k];
+    }
+}
+
+/// VectorExp, VectorLog, VectorSin, VectorCos - out[i] = f(in[i]) for
+/// `count` values.
+void VectorExp(const double *in, double *out, size_t count)
+{
+    ApplyLanes(in, out, count, ExpLanes, [](double) { return false; }, (double (*)(double))std::exp);
+}
+
+void VectorLog(const double *in, double *out, size_t count)
+{
+    ApplyLanes(in, out, count, LogLanes, [](double) { return false; }, (double (*)(double))std::log);
+}
+
+void VectorSin(const double *in, double *out, size_t count)
+{
+    ApplyLanes(in, out, count, [](const double *x, double *y) { SinCosLanes(x, y, false); },
+               [](double x) { return !(std::fabs(x) < TrigVectorLimit); }, (double (*)(double))std::sin);
+}
+
+void VectorCos(const double *in, double *out, size_t count)
+{
+    ApplyLanes(in, out, count, [](const double *x, double *y) { SinCosLanes(x, y, true); },
+               [](double x) { return !(std::fabs(x) < TrigVectorLimit); }, (double (*)(double))std::cos);
+}
+
+/// VectorIntrinsic - Apply `intrinsic` to `count` rows: `operands[k][i]` is
+/// argument k of row i, and the result of row i goes to `out[i]`. Intrinsics
+/// without a vector version are applied one row at a time.
+void VectorIntrinsic(MathIntrinsic intrinsic, const double *const *operands, double *out, size_t count)
+{
+    const double *x = operands[0];
+    switch (intrinsic)
+    {
+    case intrinsic_exp:
+        return VectorExp(x, out, count);
+    case intrinsic_log:
+        return VectorLog(x, out, count);
+    case intrinsic_sin:
+        return VectorSin(x, out, count);
+    case intrinsic_cos:
+        return VectorCos(x, out, count);
+    default:
+        break;
+    }
+    double args[2];
+    for (size_t i = 0; i < count; ++i)
+    {
+        args[0] = x[i];
+        if (intrinsic == intrinsic_pow)
+            args[1] = operands[1][i];
+        out[i] = EvaluateIntrinsic(intrinsic, args);
+    }
+}
+
+/// UlpError - Distance from `value` to `exact` in units of the last place of
+/// a double near `exact`.
+double UlpError(double value, long double exact)
+{
+    if (std::isnan(value) && std::isnan((double)exact))
+        return 0.0;
+    double rounded = (double)exact;
+    if (value == rounded)
+        return 0.0;
+    if (std::isinf(rounded) || std::isinf(value))
+        return HUGE_VAL;
+    int exponent = rounded == 0.0 ? -1074 : std::max(std::ilogb(rounded) - 52, -1074);
+    return (double)(std::fabs((long double)value - exact) / std::ldexp(1.0L, exponent));
+}
+
+/// PrintVectorMathReport - Measure each vector function against a long double
+/// reference over a range of inputs, next to libm's own error on the same
+/// inputs, and print one line per range.
+void PrintVectorMathReport(FILE *out)
+{
+    struct Case
+    {
+        const char *name;
+        void (*vector)(const double *, double *, size_t);
+        double (*libm)(double);
+        long double (*reference)(long double);
+        double low, high;
+        bool logarithmic; // sample the exponent uniformly instead of the value
+    };
+    static const Case cases[] = {
+        {"exp", VectorExp, std::exp, std::exp, -1.0, 1.0, false},
+        {"exp", VectorExp, std::exp, std::exp, -745.0, 709.0, false},
+        {"log", VectorLog, std::log, std::log, 0.5, 2.0, false},
+        {"log", VectorLog, std::log, std::log, 1e-300, 1e300, true},
+        {"sin", VectorSin, std::sin, std::sin, -M_PI, M_PI, false},
+        {"sin", VectorSin, std::sin, std::sin, -1e5, 1e5, false},
+        {"cos", VectorCos, std::cos, std::cos, -M_PI, M_PI, false},
+        {"cos", VectorCos, std::cos, std::cos, -1e5, 1e5, false},
+    };
+    const size_t samples = 1 << 18;
+
+    std::vector<double> inputs(samples), results(samples);
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (const Case& c : cases)
+    {
+        for (double& x : inputs)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            double u = (state >> 11) * 0x1p-53;
+            x = c.logarithmic ? std::exp(std::log(c.low) + u * (std::log(c.high) - std::log(c.low)))
+                              : c.low + u * (c.high - c.low);
+        }
+        c.vector(inputs.data(), results.data(), samples);
+
+        double maxUlp = 0, sumUlp = 0, libmMaxUlp = 0;
+        size_t identical = 0;
+        for (size_t i = 0; i < samples; ++i)
+        {
+            long double exact = c.reference(inputs[i]);
+            double ulp = UlpError(results[i], exact);
+            double libm = c.libm(inputs[i]);
+            maxUlp = std::max(maxUlp, ulp);
+            sumUlp += ulp;
+            libmMaxUlp = std::max(libmMaxUlp, UlpError(libm, exact));
+            identical += results[i] == libm;
+        }
+        fprintf(out, "vecmath: %s on [%g, %g]: max %.3f ulp, mean %.4f ulp (libm max %.3f ulp), %.2f%% identical to libm\n",
+                c.name, c.low, c.high, maxUlp, sumUlp / samples, libmMaxUlp, 100.0 * identical / samples);
+    }
+}
+
+#endif